@@ -0,0 +1,436 @@
+/*
+ * capture.c - Record allocator requests of a live process as binary trace.
+ *
+ * Every thread appends events to its own single producer ring. Each event
+ * takes a number from global sequence: allocations once the block has been
+ * returned and frees before the block is given back, so no block can be
+ * seen allocated again before it was freed. Writer thread merges the rings
+ * in sequence order, gives every block an id that is kept across reallocs
+ * and appends requests to the trace. Header is rewritten after each batch,
+ * so the trace stays valid even if the process never exits cleanly.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "trace.h"
+
+#define __tls __thread __attribute__((tls_model("initial-exec")))
+
+#define RING_EVENTS (1 << 14) /* Events buffered by every thread */
+#define WRITE_OPS 4096        /* Requests written to the trace at once */
+#define IDLE_NSECS 200000     /* Writer sleep when all rings are empty */
+
+typedef enum {
+  EV_ALLOC,
+  EV_FREE,
+  EV_REALLOC_BEGIN,
+  EV_REALLOC_END,
+} event_type_t;
+
+typedef struct {
+  uint64_t seq; /* Position in global order of events */
+  int type;
+  void *ptr;
+  size_t size;
+} event_t;
+
+typedef struct ring {
+  struct ring *next; /* List of all rings, it never shrinks */
+  int used;          /* Ring belongs to a thread */
+  int dead;          /* Owner has exited, reuse once drained */
+  uint64_t head __attribute__((aligned(64))); /* Next event for writer */
+  uint64_t tail __attribute__((aligned(64))); /* Next slot of the owner */
+  int realloc_id;    /* Owner's realloc in progress, writer only */
+  void *realloc_ptr;
+  event_t events[RING_EVENTS];
+} ring_t;
+
+/* Live blocks seen by writer: map from address to id with linear probing. */
+typedef struct {
+  void *ptr;
+  int id;
+} live_t;
+
+int capture_enabled;
+
+static ring_t *rings;
+static uint64_t capture_seq;     /* Number of the next event */
+static pthread_key_t ring_key;   /* Thread exit releases its ring */
+static __tls ring_t *ring;       /* Ring of calling thread */
+
+static pthread_t writer;
+static int writer_running;       /* Writer thread exists in this process */
+static int writer_stop;          /* Drain the rings and exit */
+static int trace_fd = -1;
+static tracehdr_t trace_hdr;     /* Requests and ids written so far */
+static traceop_t trace_ops[WRITE_OPS];
+static int trace_count;          /* Requests waiting in trace_ops */
+static uint64_t next_seq;        /* Event writer handles next */
+static live_t *live;
+static size_t live_mask;
+static size_t live_count;
+
+/* --=[ live blocks ]=----------------------------------------------------- */
+
+static inline size_t live_hash(void *ptr) {
+  return (((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static inline size_t live_slot(void *ptr) {
+  size_t i = live_hash(ptr) & live_mask;
+  while (live[i].ptr != NULL && live[i].ptr != ptr) {
+    i = (i + 1) & live_mask;
+  }
+  return i;
+}
+
+/* Double the table, it's kept at most half full. */
+static int live_grow(void) {
+  size_t slots = live ? 2 * (live_mask + 1) : 1 << 16;
+  live_t *old = live;
+  size_t old_slots = live ? live_mask + 1 : 0;
+  live_t *new = mmap(NULL, slots * sizeof(live_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (new == MAP_FAILED) {
+    return -1;
+  }
+  live = new;
+  live_mask = slots - 1;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].ptr != NULL) {
+      live[live_slot(old[i].ptr)] = old[i];
+    }
+  }
+  if (old != NULL) {
+    munmap(old, old_slots * sizeof(live_t));
+  }
+  return 0;
+}
+
+static int live_put(void *ptr, int id) {
+  if (2 * (live_count + 1) > live_mask + 1 && live_grow() < 0) {
+    return -1;
+  }
+  size_t i = live_slot(ptr);
+  if (live[i].ptr == NULL) {
+    live_count++;
+  }
+  live[i].ptr = ptr;
+  live[i].id = id;
+  return 0;
+}
+
+/* Returns id of the block or -1 if it wasn't allocated while recording. */
+static int live_remove(void *ptr) {
+  size_t i = live_slot(ptr);
+  if (live[i].ptr == NULL) {
+    return -1;
+  }
+  int id = live[i].id;
+  /* Shift following entries back so that no probe sequence gets broken */
+  for (size_t j = (i + 1) & live_mask; live[j].ptr != NULL;
+       j = (j + 1) & live_mask) {
+    size_t home = live_hash(live[j].ptr) & live_mask;
+    if (((j - home) & live_mask) >= ((j - i) & live_mask)) {
+      live[i] = live[j];
+      i = j;
+    }
+  }
+  live[i].ptr = NULL;
+  live_count--;
+  return id;
+}
+
+/* --=[ writer ]=---------------------------------------------------------- */
+
+/* Give up on the trace, it ends with the last request written. */
+static void writer_fail(void) {
+  if (trace_fd < 0) {
+    return;
+  }
+  __atomic_store_n(&capture_enabled, 0, __ATOMIC_RELAXED);
+  trace_count = 0;
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+static void writer_flush(void) {
+  if (trace_fd < 0 || trace_count == 0) {
+    return;
+  }
+  size_t bytes = trace_count * sizeof(traceop_t);
+  off_t offset =
+    sizeof(tracehdr_t) + (off_t)trace_hdr.num_ops * sizeof(traceop_t);
+  if (pwrite(trace_fd, trace_ops, bytes, offset) != bytes) {
+    writer_fail();
+    return;
+  }
+  trace_hdr.num_ops += trace_count;
+  trace_count = 0;
+  if (pwrite(trace_fd, &trace_hdr, sizeof(tracehdr_t), 0) !=
+      sizeof(tracehdr_t)) {
+    writer_fail();
+  }
+}
+
+static void writer_emit(int type, int id, size_t size) {
+  if (trace_fd < 0) {
+    return;
+  }
+  trace_ops[trace_count++] =
+    (traceop_t){.type = type, .index = id, .size = size};
+  if (trace_count == WRITE_OPS) {
+    writer_flush();
+  }
+}
+
+/* New block gets the next id. */
+static int writer_block(void *ptr) {
+  int id = trace_hdr.num_ids++;
+  if (live_put(ptr, id) < 0) {
+    writer_fail();
+  }
+  return id;
+}
+
+static void writer_event(ring_t *r, event_t *ev) {
+  int id;
+  switch (ev->type) {
+    case EV_ALLOC:
+      writer_emit(ALLOC, writer_block(ev->ptr), ev->size);
+      break;
+    case EV_FREE:
+      if ((id = live_remove(ev->ptr)) >= 0) {
+        writer_emit(FREE, id, 0);
+      }
+      break;
+    case EV_REALLOC_BEGIN:
+      r->realloc_id = live_remove(ev->ptr);
+      r->realloc_ptr = ev->ptr;
+      break;
+    case EV_REALLOC_END:
+      if (ev->ptr == NULL) {
+        /* Failed realloc leaves the old block in place */
+        if (r->realloc_id >= 0 && live_put(r->realloc_ptr, r->realloc_id) < 0) {
+          writer_fail();
+        }
+      } else if (r->realloc_id < 0) {
+        writer_emit(ALLOC, writer_block(ev->ptr), ev->size);
+      } else {
+        if (live_put(ev->ptr, r->realloc_id) < 0) {
+          writer_fail();
+        }
+        writer_emit(REALLOC, r->realloc_id, ev->size);
+      }
+      break;
+  }
+}
+
+/* Handle events in sequence order for as long as the next one has been
+ * published by its thread. Returns number of events handled. */
+static int writer_drain(void) {
+  int count = 0;
+  int progress;
+  do {
+    progress = 0;
+    for (ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL;
+         r = r->next) {
+      uint64_t head = r->head;
+      uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      while (head < tail && r->events[head % RING_EVENTS].seq == next_seq) {
+        writer_event(r, &r->events[head % RING_EVENTS]);
+        next_seq++;
+        head++;
+        progress++;
+      }
+      __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+      if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+          head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+        r->dead = 0;
+        __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+      }
+    }
+    count += progress;
+  } while (progress > 0);
+  return count;
+}
+
+static void *writer_main(void *arg) {
+  struct timespec idle = {0, IDLE_NSECS};
+  for (;;) {
+    int stop = __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE);
+    if (writer_drain() == 0) {
+      writer_flush();
+      if (stop) {
+        break;
+      }
+      nanosleep(&idle, NULL);
+    }
+  }
+  return NULL;
+}
+
+/* --=[ rings ]=----------------------------------------------------------- */
+
+/* Thread exit: writer recycles the ring once it's drained. */
+static void ring_detach(void *arg) {
+  ring_t *r = arg;
+  ring = NULL;
+  __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+/* Take over a ring left by exited thread or map a new one. */
+static ring_t *ring_attach(void) {
+  ring_t *r;
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    int unused = 0;
+    if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (r == NULL) {
+    r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED) {
+      return NULL;
+    }
+    r->used = 1;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  ring = r;
+  pthread_setspecific(ring_key, r);
+  return r;
+}
+
+static void capture_push(int type, void *ptr, size_t size) {
+  ring_t *r = ring;
+  if (r == NULL && (r = ring_attach()) == NULL) {
+    return;
+  }
+  /* Sequence number is taken only once there's room, since writer waits
+   * for every number in turn */
+  uint64_t tail = r->tail;
+  while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= RING_EVENTS) {
+    if (!__atomic_load_n(&capture_enabled, __ATOMIC_RELAXED)) {
+      return;
+    }
+    sched_yield();
+  }
+  event_t *ev = &r->events[tail % RING_EVENTS];
+  ev->seq = __atomic_fetch_add(&capture_seq, 1, __ATOMIC_RELAXED);
+  ev->type = type;
+  ev->ptr = ptr;
+  ev->size = size;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void capture_alloc(void *ptr, size_t size) {
+  capture_push(EV_ALLOC, ptr, size);
+}
+
+void capture_free(void *ptr) {
+  capture_push(EV_FREE, ptr, 0);
+}
+
+void capture_realloc_begin(void *ptr) {
+  capture_push(EV_REALLOC_BEGIN, ptr, 0);
+}
+
+void capture_realloc_end(void *ptr, size_t size) {
+  capture_push(EV_REALLOC_END, ptr, size);
+}
+
+/* --=[ setup ]=----------------------------------------------------------- */
+
+/* Process exit: write out everything recorded so far. */
+static void capture_finish(void) {
+  if (!writer_running) {
+    return;
+  }
+  __atomic_store_n(&capture_enabled, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(writer, NULL);
+  writer_running = 0;
+  if (trace_fd >= 0) {
+    close(trace_fd);
+  }
+}
+
+/* Writer doesn't survive fork, child isn't recorded. */
+static void capture_atfork_child(void) {
+  capture_enabled = 0;
+  writer_running = 0;
+}
+
+/* Trace name with every %p replaced by process id, so that processes
+ * started with the same environment don't overwrite each other's trace. */
+static int trace_path(char *path, size_t len, const char *name) {
+  size_t n = 0;
+  for (; *name != '\0'; name++) {
+    int w;
+    if (name[0] == '%' && name[1] == 'p') {
+      w = snprintf(path + n, len - n, "%d", (int)getpid());
+      name++;
+    } else {
+      w = snprintf(path + n, len - n, "%c", *name);
+    }
+    if (w < 0 || (n += w) >= len) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void capture_init(void) {
+  const char *name = getenv("MM_TRACE");
+  char path[PATH_MAX];
+  if (name == NULL || *name == '\0' || trace_path(path, PATH_MAX, name) < 0) {
+    return;
+  }
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    return;
+  }
+  memcpy(trace_hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  trace_hdr.version = TRACE_VERSION;
+  trace_hdr.op_size = sizeof(traceop_t);
+  trace_hdr.weight = 1;
+  if (pwrite(trace_fd, &trace_hdr, sizeof(tracehdr_t), 0) !=
+        sizeof(tracehdr_t) ||
+      live_grow() < 0 || pthread_key_create(&ring_key, ring_detach) != 0) {
+    close(trace_fd);
+    trace_fd = -1;
+    return;
+  }
+
+  /* Signals of the program are never delivered to writer */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&writer, NULL, writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    close(trace_fd);
+    trace_fd = -1;
+    return;
+  }
+  writer_running = 1;
+  pthread_atfork(NULL, NULL, capture_atfork_child);
+  atexit(capture_finish);
+  __atomic_store_n(&capture_enabled, 1, __ATOMIC_RELEASE);
+}
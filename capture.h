@@ -0,0 +1,49 @@
+/*
+ * capture.h - Recording of allocator requests made by a live process.
+ *
+ * Interposed allocator built as libmm.so writes every request into binary
+ * trace (see trace.h) named by MM_TRACE environment variable. Requests go
+ * to a ring buffer of calling thread and a background thread numbers the
+ * blocks and writes them out. Driver build never records anything.
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stddef.h>
+
+#ifdef DRIVER
+#define capture_enabled 0
+
+static inline void capture_init(void) {
+}
+
+static inline void capture_alloc(void *ptr, size_t size) {
+}
+
+static inline void capture_free(void *ptr) {
+}
+
+static inline void capture_realloc_begin(void *ptr) {
+}
+
+static inline void capture_realloc_end(void *ptr, size_t size) {
+}
+#else
+extern int capture_enabled; /* set while requests are being recorded */
+
+/* Start recording if MM_TRACE is set. Called once the heap is ready. */
+void capture_init(void);
+
+/* Block got allocated, call after the allocator returned it. */
+void capture_alloc(void *ptr, size_t size);
+
+/* Block is about to be freed, call before giving it to the allocator. */
+void capture_free(void *ptr);
+
+/* Realloc is recorded in two steps: before the old block is handed to the
+ * allocator and after the new one is returned (NULL if realloc failed). */
+void capture_realloc_begin(void *ptr);
+void capture_realloc_end(void *ptr, size_t size);
+#endif
+
+#endif /* !__CAPTURE_H__ */
@@ -1,13 +1,17 @@
 #!/usr/bin/env python3
 
 import math
+import os
 import signal
 import subprocess
 import sys
 
 
-STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_free', 'mm_init',
-                   'mm_malloc', 'mm_realloc']
+STUDENT_DEFINED = ['mm_aligned_alloc', 'mm_calloc', 'mm_checkheap',
+                   'mm_free', 'mm_free_batch', 'mm_init', 'mm_malloc',
+                   'mm_malloc_batch', 'mm_memalign', 'mm_posix_memalign',
+                   'mm_realloc', 'mm_region_alloc', 'mm_region_create',
+                   'mm_region_destroy', 'mm_stats']
 
 
 MINUTIL = 60
@@ -16,6 +20,7 @@ TRACEFILES = [
         "traces/amptjp-bal.rep",
         "traces/amptjp.rep",
         "traces/bash.rep",
+        "traces/batch.rep",
         "traces/binary.rep",
         "traces/binary-bal.rep",
         "traces/binary2.rep",
@@ -32,6 +37,7 @@ TRACEFILES = [
         "traces/expr.rep",
         "traces/expr-bal.rep",
         "traces/firefox.rep",
+        "traces/fit-scan.rep",
         "traces/fs.rep",
         "traces/hostname.rep",
         "traces/login.rep",
@@ -40,6 +46,7 @@ TRACEFILES = [
         "traces/ls.1.rep",
         "traces/malloc.rep",
         "traces/malloc-free.rep",
+        "traces/memalign.rep",
         "traces/nlydf.rep",
         "traces/perl.rep",
         "traces/perl.1.rep",
@@ -84,6 +91,9 @@ def runtrace(trace):
         "--toggle-collect=mm_free",
         "--toggle-collect=mm_realloc",
         "--toggle-collect=mm_calloc",
+        "--toggle-collect=mm_malloc_batch",
+        "--toggle-collect=mm_free_batch",
+        "--toggle-collect=mm_memalign",
         "--", "./mdriver", "-f", trace],
         capture_output=True, timeout=TIMEOUT)
 
@@ -142,6 +152,32 @@ def check_symbols():
             raise SystemExit("Your solution was disqualified! :(")
 
 
+def check_regions():
+    mdriver = subprocess.run(['./mdriver', '-R'], capture_output=True,
+                             timeout=TIMEOUT)
+    print(mdriver.stdout.decode())
+    if mdriver.returncode != 0:
+        raise SystemExit("Your regions are incorrect - check messages above!")
+
+
+def check_preload():
+    env = dict(os.environ, LD_PRELOAD=os.path.abspath('libmm.so'))
+    # realloc(NULL, 0) must not fail, gnulib xrealloc takes NULL for ENOMEM
+    checks = [
+        (['sed', 's/1/2/'], '1\n', '2\n'),
+        (['grep', 'x'], 'x\n', 'x\n'),
+        ([sys.executable, '-c',
+          'import ctypes; libc = ctypes.CDLL(None); '
+          'libc.realloc.restype = ctypes.c_void_p; '
+          'print(libc.realloc(None, 0) is not None)'], '', 'True\n')]
+    for args, stdin, expected in checks:
+        run = subprocess.run(args, input=stdin.encode(), env=env,
+                             capture_output=True, timeout=TIMEOUT)
+        if run.returncode != 0 or run.stdout.decode() != expected:
+            print(run.stderr.decode())
+            raise SystemExit(f"'{args[0]}' fails with 'libmm.so' preloaded!")
+
+
 def check_sections():
     objdump = subprocess.run(['objdump', '-h', 'mm.o'],
                              stdout=subprocess.PIPE)
@@ -163,6 +199,8 @@ def check_sections():
 if __name__ == '__main__':
     check_symbols()
     check_sections()
+    check_regions()
+    check_preload()
 
     all_ops = []
     all_insn = []
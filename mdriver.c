@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -19,11 +20,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -37,6 +46,24 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* most threads -t accepts */
+#define MAXTHREADS 64
+
+/* Latency histograms split every power of two of nanoseconds into
+ * 2^HIST_SUB_BITS buckets, so percentiles are off by at most 1/8 */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+/* number of requests in every buffer of streaming replay */
+#define STREAM_CHUNK (1 << 16)
+
+/* objects allocated and regions used by the region self-check (-R) */
+#define REGION_OPS 4000
+#define REGION_COUNT 4
+
+/* number of hardware counters read with -p */
+#define NUM_COUNTERS 5
+
 /* weights */
 #define WNONE 0
 #define WALL 1
@@ -62,13 +89,6 @@ typedef struct range_t {
   int index;            /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
   char filename[MAXLINE];
@@ -77,11 +97,22 @@ typedef struct {
   int num_ops;          /* number of distinct requests */
   int weight;           /* weight for this trace (unused) */
   traceop_t *ops;       /* array of requests */
+  size_t ops_mapped;    /* length of binary trace mapping holding ops or 0 */
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
 } trace_t;
 
+/* Histogram of latencies of one request type */
+typedef struct {
+  unsigned long count[HIST_BUCKETS]; /* number of requests in each bucket */
+  unsigned long n;                   /* number of requests */
+  unsigned long max;                 /* longest request in nanoseconds */
+} hist_t;
+
+/* One histogram for each request type, indexed by traceop_t type */
+#define NUM_OPTYPES 6
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -90,6 +121,7 @@ typedef struct {
 typedef struct {
   trace_t *trace;
   range_t *ranges;
+  hist_t *hists; /* if not NULL, time every request into these */
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -108,6 +140,21 @@ typedef struct {
   int used;    /* maximum bytes used by allocated blocks */
   int total;   /* total heap size */
 
+  /* set only when replaying with -t */
+  int threads;                        /* number of concurrent replays */
+  double mt_secs;                     /* wall time of all replays */
+  double thread_secs[MAXTHREADS];     /* time of every thread's replay */
+
+  /* set only with -L */
+  hist_t *hists;    /* latencies of single-threaded replay */
+  hist_t *mt_hists; /* latencies of all threads' replays together */
+
+  /* set only with -s */
+  mm_stats_t *heap; /* allocator state at peak heap size */
+
+  /* set only with -p */
+  double counts[NUM_COUNTERS]; /* events per request, < 0 if not counted */
+
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -132,6 +179,35 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 
 static int verbose = 1; /* global flag for verbose output */
 
+static int nthreads = 1; /* number of concurrent replays (set by -t) */
+
+static int latency = 0; /* measure every request (set by -L) */
+
+static int streaming = 0; /* replay traces without loading them (set by -S) */
+
+static int heapstats = 0; /* collect allocator statistics (set by -s) */
+
+static int perfcount = 0; /* read hardware counters (set by -p) */
+
+/* Hardware events counted with -p, all in user space only */
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counters[NUM_COUNTERS] = {
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"L1d misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"LLC misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int counter_fds[NUM_COUNTERS]; /* -1 if event is not available */
+
 /*********************
  * Function prototypes
  *********************/
@@ -149,6 +225,8 @@ static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *filename);
+static int map_trace(trace_t *trace, FILE *tracefile);
+static void write_trace(const trace_t *trace, const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -159,11 +237,26 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int *used_p, int *total_p);
+static double eval_mm_util(trace_t *trace, int *used_p, int *total_p,
+                           mm_stats_t *heap);
+static void replay_trace(trace_t *trace, int num_ops, hist_t *hists);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_speed_mt(trace_t *trace, stats_t *stats);
+static void eval_mm_stream(const char *filename, stats_t *stats);
+static int eval_mm_regions(void);
+static int perf_open(void);
+static void eval_mm_perf(trace_t *trace, stats_t *stats);
 
 /* Various helper routines */
-static void printresults(stats_t *stats);
+static void add_tracefile(char ***tracefiles, int *num_tracefiles,
+                          const char *path);
+static void printresult(stats_t *stats);
+static void printresults(int n, stats_t *stats);
+static void printsummary(int n, stats_t *stats);
+static void printresults_mt(stats_t *stats);
+static void printlatency(const char *title, hist_t *hists);
+static void printstats(const mm_stats_t *heap);
+static void printcounters(const stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
@@ -176,6 +269,76 @@ static void app_error(const char *fmt, ...)
  * High-level timing wrappers
  ****************************/
 
+/*
+ * nsecs - Return current time of monotonic clock in nanoseconds
+ */
+static inline unsigned long nsecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * hist_alloc - Return NUM_OPTYPES empty histograms
+ */
+static hist_t *hist_alloc(void) {
+  hist_t *hists = calloc(NUM_OPTYPES, sizeof(hist_t));
+  if (hists == NULL)
+    unix_error("malloc failed in hist_alloc");
+  return hists;
+}
+
+/*
+ * hist_bucket - Find bucket of given latency, the highest HIST_SUB_BITS + 1
+ *    bits select it
+ */
+static int hist_bucket(unsigned long ns) {
+  if (ns < (1 << HIST_SUB_BITS))
+    return ns;
+  int e = 63 - __builtin_clzl(ns);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         ((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/*
+ * hist_upper - Return the longest latency that falls into given bucket
+ */
+static unsigned long hist_upper(int bucket) {
+  if (bucket < (1 << HIST_SUB_BITS))
+    return bucket;
+  int e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  unsigned long m = (bucket & ((1 << HIST_SUB_BITS) - 1)) + 1;
+  return (((1 << HIST_SUB_BITS) + m) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static inline void hist_add(hist_t *hist, unsigned long ns) {
+  hist->count[hist_bucket(ns)]++;
+  hist->n++;
+  if (ns > hist->max)
+    hist->max = ns;
+}
+
+static void hist_merge(hist_t *to, const hist_t *from) {
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    to->count[b] += from->count[b];
+  to->n += from->n;
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+/*
+ * hist_percentile - Return upper bound of latency of fraction p of requests
+ */
+static unsigned long hist_percentile(const hist_t *hist, double p) {
+  unsigned long rank = p * hist->n, seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist->count[b];
+    if (seen > rank || seen == hist->n)
+      return hist_upper(b) < hist->max ? hist_upper(b) : hist->max;
+  }
+  return hist->max;
+}
+
 typedef void (*fsecs_test_funct)(void *);
 
 /*
@@ -211,12 +374,26 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   if (mm_stats->valid) {
     if (verbose > 1)
       printf("efficiency, ");
-    mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total);
+    if (heapstats && !(mm_stats->heap = calloc(1, sizeof(mm_stats_t))))
+      unix_error("calloc failed in run_tests");
+    mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total,
+                                  mm_stats->heap);
     speed_params->trace = trace;
     speed_params->ranges = ranges;
     if (verbose > 1)
       printf("and performance.\n");
+    speed_params->hists = NULL;
     mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    /* Timing every request slows replay down, so it's a separate run */
+    if (latency) {
+      mm_stats->hists = hist_alloc();
+      speed_params->hists = mm_stats->hists;
+      eval_mm_speed(speed_params);
+    }
+    if (perfcount)
+      eval_mm_perf(trace, mm_stats);
+    if (nthreads > 1)
+      eval_mm_speed_mt(trace, mm_stats);
   }
 
   free_trace(trace);
@@ -229,12 +406,16 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
  * Main routine
  **************/
 int main(int argc, char **argv) {
-  char *tracefile = NULL; /* trace file names */
-  range_t *ranges = NULL; /* keeps track of block extents for one trace */
-  stats_t libc_stats;     /* libc stats for trace */
-  stats_t mm_stats;       /* mm (i.e. student) stats for trace */
-  speed_t speed_params;   /* input parameters to the xx_speed routines */
-  int run_libc = 0;       /* If set, run libc malloc (set by -l) */
+  char **tracefiles = NULL; /* trace file names */
+  int num_tracefiles = 0;   /* number of traces to run */
+  range_t *ranges = NULL;   /* keeps track of block extents for one trace */
+  stats_t *libc_stats;      /* libc stats for each trace */
+  stats_t *mm_stats;        /* mm (i.e. student) stats for each trace */
+  speed_t speed_params;     /* input parameters to the xx_speed routines */
+  int run_libc = 0;         /* If set, run libc malloc (set by -l) */
+  int all_valid = 1;        /* Were all traces processed correctly? */
+  char *binfile = NULL;     /* Convert the trace to this file (set by -c) */
+  int regions = 0;          /* If set, run region self-check (set by -R) */
 
   setbuf(stdout, 0);
   setbuf(stderr, 0);
@@ -243,10 +424,45 @@ int main(int argc, char **argv) {
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv, "c:d:f:t:v:hVlLpsSRD")) != EOF) {
     switch (c) {
-      case 'f': /* Use one specific trace file only (relative to curr dir) */
-        tracefile = strdup(optarg);
+      case 'f': /* Use trace file or directory (relative to curr dir) */
+        add_tracefile(&tracefiles, &num_tracefiles, optarg);
+        break;
+
+      case 'c': /* Convert the trace to binary format */
+        binfile = strdup(optarg);
+        break;
+
+      case 't': /* Replay the trace on this many threads at once */
+        nthreads = atoi(optarg);
+        if (nthreads < 1 || nthreads > MAXTHREADS)
+          app_error("Number of threads must be between 1 and %d\n",
+                    MAXTHREADS);
+#if !THREADS
+        if (nthreads > 1)
+          app_error("-t needs allocator built with MMFLAGS=-DTHREADS=1\n");
+#endif
+        break;
+
+      case 'S': /* Stream traces from disk while replaying them */
+        streaming = 1;
+        break;
+
+      case 'R': /* Check region allocator and exit */
+        regions = 1;
+        break;
+
+      case 'L': /* Measure latency of every request */
+        latency = 1;
+        break;
+
+      case 's': /* Print allocator statistics */
+        heapstats = 1;
+        break;
+
+      case 'p': /* Read hardware counters while replaying */
+        perfcount = 1;
         break;
 
       case 'l': /* Run libc malloc */
@@ -279,11 +495,40 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (tracefile == NULL) {
+  /* Remaining arguments are trace files or directories too */
+  for (int i = optind; i < argc; i++)
+    add_tracefile(&tracefiles, &num_tracefiles, argv[i]);
+
+  if (regions) {
+    int valid = eval_mm_regions();
+    printf("Region self-check: %s\n", valid ? "yes" : "no");
+    return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (num_tracefiles == 0) {
     usage();
     exit(EXIT_FAILURE);
   }
 
+  if (streaming &&
+      (run_libc || latency || heapstats || perfcount || nthreads > 1))
+    app_error("-S can't be combined with -l, -L, -p, -s or -t\n");
+
+  if (perfcount && perf_open() == 0) {
+    printf("Hardware counters are not available: %s\n", strerror(errno));
+    perfcount = 0;
+  }
+
+  if (binfile != NULL) {
+    if (num_tracefiles != 1)
+      app_error("-c converts exactly one trace\n");
+    stats_t stats;
+    trace_t *trace = read_trace(&stats, tracefiles[0]);
+    write_trace(trace, binfile);
+    free_trace(trace);
+    return EXIT_SUCCESS;
+  }
+
   if (debug_mode != DBG_NONE)
     init_random_data();
 
@@ -294,23 +539,29 @@ int main(int argc, char **argv) {
     if (verbose > 1)
       printf("\nTesting libc malloc\n");
 
+    if (!(libc_stats = calloc(num_tracefiles, sizeof(stats_t))))
+      unix_error("calloc failed in main");
+
     /* Evaluate the libc malloc package using the K-best scheme */
-    trace_t *trace = read_trace(&libc_stats, tracefile);
+    for (int i = 0; i < num_tracefiles; i++) {
+      trace_t *trace = read_trace(&libc_stats[i], tracefiles[i]);
 
-    libc_stats.valid = eval_libc_valid(trace);
-    if (libc_stats.valid) {
-      speed_params.trace = trace;
-      libc_stats.secs = fsecs(eval_libc_speed, &speed_params);
+      libc_stats[i].valid = eval_libc_valid(trace);
+      if (libc_stats[i].valid) {
+        speed_params.trace = trace;
+        libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+      }
+      all_valid &= libc_stats[i].valid;
+      free_trace(trace);
     }
-    free_trace(trace);
 
     /* Display the libc results in a compact table */
     if (verbose) {
       printf("\nResults for libc malloc:\n");
-      printresults(&libc_stats);
+      printresults(num_tracefiles, libc_stats);
     }
 
-    return libc_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
+    return all_valid ? EXIT_SUCCESS : EXIT_FAILURE;
   }
 
   /*
@@ -320,15 +571,78 @@ int main(int argc, char **argv) {
     printf("\nTesting mm malloc\n");
 
   /* Allocate the mm stats array, with one stats_t struct per tracefile */
-  run_tests(tracefile, &mm_stats, ranges, &speed_params);
+  if (!(mm_stats = calloc(num_tracefiles, sizeof(stats_t))))
+    unix_error("calloc failed in main");
+
+  for (int i = 0; i < num_tracefiles; i++) {
+    if (streaming)
+      eval_mm_stream(tracefiles[i], &mm_stats[i]);
+    else
+      run_tests(tracefiles[i], &mm_stats[i], ranges, &speed_params);
+    all_valid &= mm_stats[i].valid;
+  }
 
   /* Display the mm results */
   if (verbose) {
     printf("\nResults for mm malloc:\n");
-    printresults(&mm_stats);
+    printresults(num_tracefiles, mm_stats);
+    if (num_tracefiles > 1)
+      printsummary(num_tracefiles, mm_stats);
+    for (int i = 0; i < num_tracefiles; i++) {
+      stats_t *stats = &mm_stats[i];
+      if (!stats->valid)
+        continue;
+      if (num_tracefiles > 1 &&
+          (latency || heapstats || perfcount || nthreads > 1))
+        printf("\n%s:\n", stats->filename);
+      if (heapstats)
+        printstats(stats->heap);
+      if (perfcount)
+        printcounters(stats);
+      if (latency)
+        printlatency("Latency", stats->hists);
+      if (nthreads > 1)
+        printresults_mt(stats);
+      if (nthreads > 1 && latency)
+        printlatency("Latency on all threads", stats->mt_hists);
+    }
   }
 
-  return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
+  return all_valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * add_tracefile - Append trace file to the list of traces to run. Given a
+ *     directory, append all *.rep files in it in alphabetical order.
+ */
+static void add_tracefile(char ***tracefiles, int *num_tracefiles,
+                          const char *path) {
+  struct stat st;
+  struct dirent **names;
+  int n;
+
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    *tracefiles = realloc(*tracefiles, (*num_tracefiles + 1) * sizeof(char *));
+    if (*tracefiles == NULL)
+      unix_error("realloc failed in add_tracefile");
+    (*tracefiles)[(*num_tracefiles)++] = strdup(path);
+    return;
+  }
+
+  if ((n = scandir(path, &names, NULL, alphasort)) < 0)
+    unix_error("Could not read directory %s", path);
+
+  for (int i = 0; i < n; i++) {
+    const char *name = names[i]->d_name;
+    size_t len = strlen(name);
+    if (len > 4 && strcmp(name + len - 4, ".rep") == 0) {
+      char file[MAXLINE];
+      snprintf(file, sizeof(file), "%s/%s", path, name);
+      add_tracefile(tracefiles, num_tracefiles, file);
+    }
+    free(names[i]);
+  }
+  free(names);
 }
 
 /*****************************************************************
@@ -503,11 +817,15 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   if (!(tracefile = fopen(trace->filename, "r")))
     unix_error("Could not open %s in read_trace", trace->filename);
 
+  /* Binary traces are used in place, text ones are parsed below */
   int ignore = 0;
-  ignore += fscanf(tracefile, "%d", &trace->weight);
-  ignore += fscanf(tracefile, "%d", &trace->num_ids);
-  ignore += fscanf(tracefile, "%d", &trace->num_ops);
-  ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
+  trace->ops_mapped = 0;
+  if (!map_trace(trace, tracefile)) {
+    ignore += fscanf(tracefile, "%d", &trace->weight);
+    ignore += fscanf(tracefile, "%d", &trace->num_ids);
+    ignore += fscanf(tracefile, "%d", &trace->num_ops);
+    ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
+  }
 
   if (trace->weight < 0 || trace->weight > 3)
     app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
@@ -515,7 +833,8 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
     app_error("%s: ignore-ranges can only be zero or one", trace->filename);
 
   /* We'll store each request line in the trace in this array */
-  if (!(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
+  if (!trace->ops_mapped &&
+      !(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
     unix_error("malloc 2 failed in read_trace");
 
   /* We'll keep an array of pointers to the allocated blocks here... */
@@ -536,9 +855,29 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   int op_index = 0;
   int max_index = 0;
   char type[MAXLINE];
-  int size;
+  int size, count;
+
+  /* Mapped requests are used as-is, so make sure every id fits */
+  for (; trace->ops_mapped && op_index < trace->num_ops; op_index++) {
+    const traceop_t *op = &trace->ops[op_index];
+    int batch = op->type == ALLOC_BATCH || op->type == FREE_BATCH;
+    count = batch ? op->count : 1;
+    if (op->type < ALLOC || op->type > MEMALIGN)
+      app_error("%s: bogus request type (%d) at request %d\n",
+                trace->filename, op->type, op_index);
+    if (op->type == MEMALIGN && (op->count < 1 || op->count & (op->count - 1)))
+      app_error("%s: bogus alignment (%d) at request %d\n", trace->filename,
+                op->count, op_index);
+    if (op->index < 0 || count < 1 ||
+        (long)op->index + count > trace->num_ids)
+      app_error("%s: block ids out of range at request %d\n", trace->filename,
+                op_index);
+    if (op->type != FREE && op->type != FREE_BATCH &&
+        op->index + count - 1 > max_index)
+      max_index = op->index + count - 1;
+  }
 
-  while (fscanf(tracefile, "%s", type) != EOF) {
+  while (!trace->ops_mapped && fscanf(tracefile, "%s", type) != EOF) {
     switch (type[0]) {
       case 'a':
         ignore += fscanf(tracefile, "%u %u", &index, &size);
@@ -562,6 +901,32 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
         trace->ops[op_index].index = index;
         break;
 
+      case 'A':
+        ignore += fscanf(tracefile, "%u %u %u", &index, &count, &size);
+        trace->ops[op_index].type = ALLOC_BATCH;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        trace->ops[op_index].size = size;
+        max_index = (index + count - 1 > max_index) ? index + count - 1
+                                                    : max_index;
+        break;
+
+      case 'F':
+        ignore += fscanf(tracefile, "%u %u", &index, &count);
+        trace->ops[op_index].type = FREE_BATCH;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        break;
+
+      case 'm':
+        ignore += fscanf(tracefile, "%u %u %u", &index, &count, &size);
+        trace->ops[op_index].type = MEMALIGN;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        trace->ops[op_index].size = size;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+
       default:
         app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                   trace->filename);
@@ -583,6 +948,65 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   return trace;
 }
 
+/*
+ * map_trace - if tracefile is a binary trace, fill in trace header and
+ *    map requests into memory. Otherwise rewind the file and return 0.
+ */
+static int map_trace(trace_t *trace, FILE *tracefile) {
+  tracehdr_t hdr;
+  struct stat st;
+
+  if (fread(&hdr, sizeof(hdr), 1, tracefile) != 1 ||
+      memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+    rewind(tracefile);
+    return 0;
+  }
+
+  if (hdr.version != TRACE_VERSION || hdr.op_size != sizeof(traceop_t))
+    app_error("%s: unsupported binary trace version or layout\n",
+              trace->filename);
+  if (fstat(fileno(tracefile), &st) < 0)
+    unix_error("Could not stat %s in map_trace", trace->filename);
+  if (hdr.num_ops < 0 || hdr.num_ids < 0 ||
+      st.st_size < sizeof(hdr) + (off_t)hdr.num_ops * sizeof(traceop_t))
+    app_error("%s: binary trace is truncated\n", trace->filename);
+
+  trace->weight = hdr.weight;
+  trace->num_ids = hdr.num_ids;
+  trace->num_ops = hdr.num_ops;
+  trace->ignore_ranges = hdr.ignore_ranges;
+  trace->ops_mapped = sizeof(hdr) + hdr.num_ops * sizeof(traceop_t);
+
+  void *map = mmap(NULL, trace->ops_mapped, PROT_READ, MAP_PRIVATE,
+                   fileno(tracefile), 0);
+  if (map == MAP_FAILED)
+    unix_error("Could not map %s in map_trace", trace->filename);
+  trace->ops = (traceop_t *)((char *)map + sizeof(hdr));
+  return 1;
+}
+
+/*
+ * write_trace - store trace in binary format
+ */
+static void write_trace(const trace_t *trace, const char *filename) {
+  tracehdr_t hdr = {.magic = TRACE_MAGIC,
+                    .version = TRACE_VERSION,
+                    .op_size = sizeof(traceop_t),
+                    .weight = trace->weight,
+                    .num_ids = trace->num_ids,
+                    .num_ops = trace->num_ops,
+                    .ignore_ranges = trace->ignore_ranges};
+  FILE *file;
+
+  if (!(file = fopen(filename, "w")))
+    unix_error("Could not open %s in write_trace", filename);
+  if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+      fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, file) !=
+        trace->num_ops ||
+      fclose(file) != 0)
+    unix_error("Could not write %s in write_trace", filename);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -597,7 +1021,10 @@ static void reinit_trace(trace_t *trace) {
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace) {
-  free(trace->ops); /* free the three arrays... */
+  if (trace->ops_mapped) /* requests of binary trace are only mapped */
+    munmap((char *)trace->ops - sizeof(tracehdr_t), trace->ops_mapped);
+  else
+    free(trace->ops); /* free the four arrays... */
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace->block_rand_base);
@@ -715,6 +1142,46 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
         mm_free(p);
         break;
 
+      case ALLOC_BATCH: /* mm_malloc_batch */
+        if (mm_malloc_batch(size, trace->ops[i].count,
+                            (void **)&trace->blocks[index]) !=
+            trace->ops[i].count) {
+          malloc_error(trace, i, "mm_malloc_batch failed.");
+          return 0;
+        }
+        for (int j = index; j < index + trace->ops[i].count; j++) {
+          if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+            return 0;
+          trace->block_sizes[j] = size;
+          randomize_block(trace, j);
+        }
+        break;
+
+      case FREE_BATCH: /* mm_free_batch */
+        for (int j = index; j < index + trace->ops[i].count; j++) {
+          check_index(trace, i, j);
+          remove_range(ranges, trace->blocks[j]);
+        }
+        mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        if ((p = mm_memalign(trace->ops[i].count, size)) == NULL) {
+          malloc_error(trace, i, "mm_memalign failed.");
+          return 0;
+        }
+        if ((uintptr_t)p % trace->ops[i].count != 0) {
+          malloc_error(trace, i, "mm_memalign block is not aligned to %d.",
+                       trace->ops[i].count);
+          return 0;
+        }
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+          return 0;
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        randomize_block(trace, index);
+        break;
+
       default:
         app_error("Nonexistent request type in eval_mm_valid");
     }
@@ -730,15 +1197,22 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace. Since the heap can be shrunk with mem_trim(),
+ *   heapsize is the high water mark of brk reported by mem_heappeak().
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   If heap is given, it gets allocator state right after the request that
+ *   brought the heap to its peak size and event counts of the whole run.
+ *   Since mm_stats walks the whole heap, the run only remembers that
+ *   request and the trace is replayed up to it once more for the snapshot.
  */
-static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
+static double eval_mm_util(trace_t *trace, int *used_p, int *total_p,
+                           mm_stats_t *heap) {
   int max_total_size = 0;
   int total_size = 0;
+  size_t heap_peak = 0;
+  int peak_op = 0;
 
   reinit_trace(trace);
 
@@ -748,7 +1222,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
     app_error("trace: mm_init failed in eval_mm_util");
 
   for (int i = 0; i < trace->num_ops; i++) {
-    int index, size, newsize, oldsize;
+    int index, size, newsize, oldsize, count;
     char *p, *newp, *oldp;
 
     switch (trace->ops[i].type) {
@@ -797,6 +1271,43 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         total_size -= size;
         break;
 
+      case ALLOC_BATCH: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        count = trace->ops[i].count;
+
+        if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+            count)
+          app_error("trace: mm_malloc_batch failed in eval_mm_util");
+
+        for (int j = index; j < index + count; j++)
+          trace->block_sizes[j] = size;
+        total_size += size * count;
+        break;
+
+      case FREE_BATCH: /* mm_free_batch */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+
+        mm_free_batch((void **)&trace->blocks[index], count);
+
+        for (int j = index; j < index + count; j++)
+          total_size -= trace->block_sizes[j];
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        if ((p = mm_memalign(trace->ops[i].count, size)) == NULL)
+          app_error("trace: mm_memalign failed in eval_mm_util");
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        total_size += size;
+        break;
+
       default:
         app_error("trace: Nonexistent request type in eval_mm_util");
     }
@@ -804,31 +1315,42 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
     /* update the high-water mark */
     max_total_size =
       (total_size > max_total_size) ? total_size : max_total_size;
+
+    if (mem_heappeak() > heap_peak) {
+      heap_peak = mem_heappeak();
+      peak_op = i;
+    }
   }
 
   *used_p = max_total_size;
-  *total_p = mem_heapsize();
+  *total_p = mem_heappeak();
+
+  if (heap != NULL) {
+    mm_stats_t end;
+    mm_stats(&end);
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+      app_error("trace: mm_init failed in eval_mm_util");
+    replay_trace(trace, peak_op + 1, NULL);
+    mm_stats(heap);
+    heap->events = end.events;
+  }
 
-  return ((double)max_total_size / (double)mem_heapsize());
+  return ((double)*used_p / (double)*total_p);
 }
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * replay_trace - Run first num_ops requests of the trace against mm malloc
+ *    package, without any checks. Used for timing.
  */
-static void eval_mm_speed(void *ptr) {
-  trace_t *trace = ((speed_t *)ptr)->trace;
-  reinit_trace(trace);
-
-  /* Reset the heap and initialize the mm package */
-  mem_reset_brk();
-  if (mm_init() < 0)
-    app_error("mm_init failed in eval_mm_speed");
-
+static void replay_trace(trace_t *trace, int num_ops, hist_t *hists) {
   /* Interpret each trace request */
-  for (int i = 0; i < trace->num_ops; i++) {
+  for (int i = 0; i < num_ops; i++) {
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
+    unsigned long start = hists ? nsecs() : 0;
 
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_malloc */
@@ -858,12 +1380,640 @@ static void eval_mm_speed(void *ptr) {
         mm_free(block);
         break;
 
+      case ALLOC_BATCH: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        if (mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                            (void **)&trace->blocks[index]) !=
+            trace->ops[i].count)
+          app_error("mm_malloc_batch error in eval_mm_speed");
+        break;
+
+      case FREE_BATCH: /* mm_free_batch */
+        index = trace->ops[i].index;
+        mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        p = mm_memalign(trace->ops[i].count, trace->ops[i].size);
+        if (p == NULL)
+          app_error("mm_memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
       default:
         app_error("Nonexistent request type in eval_mm_speed");
     }
+
+    if (hists)
+      hist_add(&hists[trace->ops[i].type], nsecs() - start);
   }
 }
 
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr) {
+  trace_t *trace = ((speed_t *)ptr)->trace;
+  reinit_trace(trace);
+
+  /* Reset the heap and initialize the mm package */
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_speed");
+
+  replay_trace(trace, trace->num_ops, ((speed_t *)ptr)->hists);
+}
+
+/*
+ * perf_open - Open every hardware counter of -p that this machine has,
+ *    counting user space of this process. Returns number of counters.
+ */
+static int perf_open(void) {
+  int opened = 0;
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    struct perf_event_attr attr = {
+      .size = sizeof(attr),
+      .type = counters[i].type,
+      .config = counters[i].config,
+      .disabled = 1,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+      .read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING};
+    counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (counter_fds[i] >= 0)
+      opened++;
+  }
+  return opened;
+}
+
+/*
+ * eval_mm_perf - Replay the trace once more with hardware counters running.
+ *    Counting starts after mm_init and covers the whole replay loop, since
+ *    switching counters on and off around each call would take a syscall
+ *    and evict the very cache lines that are measured. When the kernel has
+ *    to multiplex counters, counts are scaled up to the whole replay.
+ */
+static void eval_mm_perf(trace_t *trace, stats_t *stats) {
+  reinit_trace(trace);
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_perf");
+
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  replay_trace(trace, trace->num_ops, NULL);
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] >= 0)
+      ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    uint64_t value[3]; /* count, time enabled, time running */
+    stats->counts[i] = -1;
+    if (counter_fds[i] < 0 ||
+        read(counter_fds[i], value, sizeof(value)) != sizeof(value) ||
+        value[2] == 0)
+      continue;
+    stats->counts[i] =
+      (double)value[0] * value[1] / value[2] / trace->num_ops;
+  }
+}
+
+/* Parameters and result of one thread replaying its copy of a trace */
+typedef struct {
+  trace_t trace;              /* shares ops, has its own blocks array */
+  pthread_barrier_t *barrier; /* all threads start at the same time */
+  struct timeval stv, etv;    /* start and end of this thread's replay */
+  hist_t *hists;              /* this thread's latencies if -L is given */
+} replay_t;
+
+static void *replay_thread(void *ptr) {
+  replay_t *replay = ptr;
+  pthread_barrier_wait(replay->barrier);
+  gettimeofday(&replay->stv, NULL);
+  replay_trace(&replay->trace, replay->trace.num_ops, replay->hists);
+  gettimeofday(&replay->etv, NULL);
+  return NULL;
+}
+
+/* Seconds between two points in time */
+static double tvsecs(struct timeval *stv, struct timeval *etv) {
+  return (etv->tv_sec - stv->tv_sec) + 1E-6 * (etv->tv_usec - stv->tv_usec);
+}
+
+/*
+ * eval_mm_speed_mt - Replay nthreads copies of the trace at the same time
+ *    on one heap. Every copy has its own set of blocks, so the heap has
+ *    to hold nthreads times more data than in single-threaded run.
+ */
+static void eval_mm_speed_mt(trace_t *trace, stats_t *stats) {
+  pthread_t tids[MAXTHREADS];
+  replay_t replays[MAXTHREADS];
+  pthread_barrier_t barrier;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_speed_mt");
+
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  for (int t = 0; t < nthreads; t++) {
+    replays[t].trace = *trace;
+    replays[t].barrier = &barrier;
+    replays[t].hists = latency ? hist_alloc() : NULL;
+    if (!(replays[t].trace.blocks = calloc(trace->num_ids, sizeof(char *))))
+      unix_error("malloc failed in eval_mm_speed_mt");
+    errno = pthread_create(&tids[t], NULL, replay_thread, &replays[t]);
+    if (errno != 0)
+      unix_error("pthread_create failed in eval_mm_speed_mt");
+  }
+
+  /* Wall time spans from the first start to the last end of a replay */
+  struct timeval *stv = &replays[0].stv, *etv = &replays[0].etv;
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(tids[t], NULL);
+    free(replays[t].trace.blocks);
+    if (latency) {
+      if (t == 0)
+        stats->mt_hists = hist_alloc();
+      for (int type = 0; type < NUM_OPTYPES; type++)
+        hist_merge(&stats->mt_hists[type], &replays[t].hists[type]);
+      free(replays[t].hists);
+    }
+    stats->thread_secs[t] = tvsecs(&replays[t].stv, &replays[t].etv);
+    if (tvsecs(&replays[t].stv, stv) > 0)
+      stv = &replays[t].stv;
+    if (tvsecs(etv, &replays[t].etv) > 0)
+      etv = &replays[t].etv;
+  }
+  pthread_barrier_destroy(&barrier);
+
+  stats->threads = nthreads;
+  stats->mt_secs = tvsecs(stv, etv);
+}
+
+/*********************************************************************
+ * Streaming replay reads the trace in STREAM_CHUNK requests long pieces
+ * while it's being replayed, so traces of any length can be used. The
+ * reader thread fills one buffer while the other one is replayed. Blocks
+ * are tracked in a hash table of live ids only.
+ *********************************************************************/
+
+/* Live block of streamed trace */
+typedef struct {
+  int index;   /* block id or -1 for empty slot */
+  size_t size; /* payload size */
+  char *ptr;   /* payload address */
+} live_t;
+
+/* Open addressing hash table with linear probing, at most half full */
+typedef struct {
+  live_t *slots;
+  size_t mask; /* number of slots - 1 */
+  size_t used; /* number of live blocks */
+} livemap_t;
+
+static inline size_t live_hash(const livemap_t *map, int index) {
+  return ((unsigned)index * 2654435761U) & map->mask;
+}
+
+static void live_init(livemap_t *map, size_t nslots) {
+  if (!(map->slots = malloc(nslots * sizeof(live_t))))
+    unix_error("malloc failed in live_init");
+  for (size_t i = 0; i < nslots; i++)
+    map->slots[i].index = -1;
+  map->mask = nslots - 1;
+  map->used = 0;
+}
+
+/* Return slot of given id or the empty slot where it belongs */
+static live_t *live_find(livemap_t *map, int index) {
+  size_t i = live_hash(map, index);
+  while (map->slots[i].index != -1 && map->slots[i].index != index)
+    i = (i + 1) & map->mask;
+  return &map->slots[i];
+}
+
+static void live_put(livemap_t *map, int index, char *ptr, size_t size) {
+  live_t *live = live_find(map, index);
+  if (live->index == -1 && ++map->used > map->mask / 2) {
+    /* Rehash into a table twice as big */
+    livemap_t old = *map;
+    live_init(map, (old.mask + 1) * 2);
+    for (size_t i = 0; i <= old.mask; i++)
+      if (old.slots[i].index != -1)
+        *live_find(map, old.slots[i].index) = old.slots[i];
+    map->used = old.used;
+    free(old.slots);
+    live = live_find(map, index);
+  }
+  live->index = index;
+  live->ptr = ptr;
+  live->size = size;
+}
+
+/* Remove slot and move back entries that would become unreachable */
+static void live_remove(livemap_t *map, live_t *live) {
+  size_t i = live - map->slots;
+  size_t j = i;
+  map->used--;
+  for (;;) {
+    j = (j + 1) & map->mask;
+    if (map->slots[j].index == -1)
+      break;
+    size_t k = live_hash(map, map->slots[j].index);
+    /* Entry at j stays if its home slot k lies cyclically in (i, j] */
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    map->slots[i] = map->slots[j];
+    i = j;
+  }
+  map->slots[i].index = -1;
+}
+
+/* Double-buffered reader of a trace file */
+typedef struct {
+  FILE *file;
+  int binary;                /* binary trace, otherwise .rep text */
+  const char *filename;
+  int remaining;             /* requests not read yet */
+  traceop_t *bufs[2];        /* request buffers */
+  int counts[2];             /* requests in full buffer or -1 if empty */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} stream_t;
+
+/* Read up to STREAM_CHUNK requests from the trace file */
+static int stream_read(stream_t *stream, traceop_t *ops) {
+  int n = STREAM_CHUNK < stream->remaining ? STREAM_CHUNK : stream->remaining;
+  if (stream->binary) {
+    n = fread(ops, sizeof(traceop_t), n, stream->file);
+  } else {
+    char type[MAXLINE];
+    int i;
+    for (i = 0; i < n && fscanf(stream->file, "%s", type) == 1; i++) {
+      unsigned index = 0, count = 0, size = 0;
+      int fields = 0;
+      switch (type[0]) {
+        case 'a':
+          ops[i].type = ALLOC;
+          fields = fscanf(stream->file, "%u %u", &index, &size);
+          break;
+        case 'r':
+          ops[i].type = REALLOC;
+          fields = fscanf(stream->file, "%u %u", &index, &size);
+          break;
+        case 'f':
+          ops[i].type = FREE;
+          fields = fscanf(stream->file, "%u", &index);
+          break;
+        case 'A':
+          ops[i].type = ALLOC_BATCH;
+          fields = fscanf(stream->file, "%u %u %u", &index, &count, &size);
+          break;
+        case 'F':
+          ops[i].type = FREE_BATCH;
+          fields = fscanf(stream->file, "%u %u", &index, &count);
+          break;
+        case 'm':
+          ops[i].type = MEMALIGN;
+          fields = fscanf(stream->file, "%u %u %u", &index, &count, &size);
+          break;
+      }
+      if (fields < 1)
+        app_error("Bogus request (%s) in tracefile %s\n", type,
+                  stream->filename);
+      ops[i].index = index;
+      ops[i].count = count;
+      ops[i].size = size;
+    }
+    n = i;
+  }
+  stream->remaining -= n;
+  return n;
+}
+
+/* Reader thread, fills buffers in turn until the trace ends */
+static void *stream_reader(void *ptr) {
+  stream_t *stream = ptr;
+  int n;
+  for (int b = 0;; b ^= 1) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->counts[b] != -1)
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    pthread_mutex_unlock(&stream->lock);
+
+    n = stream_read(stream, stream->bufs[b]);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->counts[b] = n;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    if (n == 0)
+      return NULL;
+  }
+}
+
+/* Wait for buffer b to be filled, return number of requests in it */
+static int stream_wait(stream_t *stream, int b) {
+  pthread_mutex_lock(&stream->lock);
+  while (stream->counts[b] == -1)
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  int n = stream->counts[b];
+  pthread_mutex_unlock(&stream->lock);
+  return n;
+}
+
+/* Hand buffer b back to the reader */
+static void stream_release(stream_t *stream, int b) {
+  pthread_mutex_lock(&stream->lock);
+  stream->counts[b] = -1;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+/*
+ * eval_mm_stream - Replay trace while it's being read and measure space
+ *    utilization and throughput at once. Requests aren't checked for
+ *    correctness and time includes bookkeeping of live blocks.
+ */
+static void eval_mm_stream(const char *filename, stats_t *stats) {
+  stream_t stream = {.filename = filename, .counts = {-1, -1}};
+  tracehdr_t hdr;
+  livemap_t live;
+  pthread_t reader;
+  struct timeval stv, etv;
+  size_t total_size = 0, max_total_size = 0;
+  void **batch = NULL; /* blocks of batch request */
+  int batch_size = 0;
+  int ignore = 0;
+
+  if (!(stream.file = fopen(filename, "r")))
+    unix_error("Could not open %s in eval_mm_stream", filename);
+  if (fread(&hdr, sizeof(hdr), 1, stream.file) == 1 &&
+      memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) == 0) {
+    if (hdr.version != TRACE_VERSION || hdr.op_size != sizeof(traceop_t))
+      app_error("%s: unsupported binary trace version or layout\n", filename);
+    stream.binary = 1;
+  } else {
+    rewind(stream.file);
+    ignore += fscanf(stream.file, "%d", &hdr.weight);
+    ignore += fscanf(stream.file, "%d", &hdr.num_ids);
+    ignore += fscanf(stream.file, "%d", &hdr.num_ops);
+    ignore += fscanf(stream.file, "%d", &hdr.ignore_ranges);
+  }
+  stream.remaining = hdr.num_ops;
+
+  strcpy(stats->filename, filename);
+  stats->weight = hdr.weight;
+  stats->ops = 0;
+
+  for (int b = 0; b < 2; b++)
+    if (!(stream.bufs[b] = malloc(STREAM_CHUNK * sizeof(traceop_t))))
+      unix_error("malloc failed in eval_mm_stream");
+  live_init(&live, 1024);
+  pthread_mutex_init(&stream.lock, NULL);
+  pthread_cond_init(&stream.cond, NULL);
+
+  mem_init();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_stream");
+
+  errno = pthread_create(&reader, NULL, stream_reader, &stream);
+  if (errno != 0)
+    unix_error("pthread_create failed in eval_mm_stream");
+
+  gettimeofday(&stv, NULL);
+  int n;
+  for (int b = 0; (n = stream_wait(&stream, b)) > 0; b ^= 1) {
+    traceop_t *ops = stream.bufs[b];
+    for (int i = 0; i < n; i++) {
+      live_t *block = live_find(&live, ops[i].index);
+      char *p;
+
+      switch (ops[i].type) {
+        case ALLOC:
+        case MEMALIGN:
+          p = ops[i].type == ALLOC ? mm_malloc(ops[i].size)
+                                   : mm_memalign(ops[i].count, ops[i].size);
+          if (p == NULL)
+            app_error("mm_malloc or mm_memalign error in eval_mm_stream");
+          if (block->index != -1)
+            total_size -= block->size;
+          live_put(&live, ops[i].index, p, ops[i].size);
+          total_size += ops[i].size;
+          break;
+
+        case REALLOC:
+          p = mm_realloc(block->index != -1 ? block->ptr : NULL, ops[i].size);
+          if (p == NULL && ops[i].size != 0)
+            app_error("mm_realloc error in eval_mm_stream");
+          if (block->index != -1) {
+            total_size -= block->size;
+            live_remove(&live, block);
+          }
+          if (p != NULL) {
+            live_put(&live, ops[i].index, p, ops[i].size);
+            total_size += ops[i].size;
+          }
+          break;
+
+        case FREE:
+          if (ops[i].index < 0 || block->index == -1) {
+            mm_free(NULL);
+          } else {
+            mm_free(block->ptr);
+            total_size -= block->size;
+            live_remove(&live, block);
+          }
+          break;
+
+        case ALLOC_BATCH:
+        case FREE_BATCH:
+          if (ops[i].count > batch_size) {
+            batch_size = ops[i].count;
+            if (!(batch = realloc(batch, batch_size * sizeof(void *))))
+              unix_error("realloc failed in eval_mm_stream");
+          }
+          if (ops[i].type == ALLOC_BATCH) {
+            if (mm_malloc_batch(ops[i].size, ops[i].count, batch) !=
+                ops[i].count)
+              app_error("mm_malloc_batch error in eval_mm_stream");
+            for (int j = 0; j < ops[i].count; j++) {
+              block = live_find(&live, ops[i].index + j);
+              if (block->index != -1)
+                total_size -= block->size;
+              live_put(&live, ops[i].index + j, batch[j], ops[i].size);
+              total_size += ops[i].size;
+            }
+          } else {
+            int m = 0;
+            for (int j = 0; j < ops[i].count; j++) {
+              block = live_find(&live, ops[i].index + j);
+              if (block->index == -1)
+                continue;
+              batch[m++] = block->ptr;
+              total_size -= block->size;
+              live_remove(&live, block);
+            }
+            mm_free_batch(batch, m);
+          }
+          break;
+
+        default:
+          app_error("Nonexistent request type in eval_mm_stream");
+      }
+
+      if (total_size > max_total_size)
+        max_total_size = total_size;
+    }
+    stats->ops += n;
+    stream_release(&stream, b);
+  }
+  gettimeofday(&etv, NULL);
+
+  pthread_join(reader, NULL);
+  fclose(stream.file);
+  free(stream.bufs[0]);
+  free(stream.bufs[1]);
+  free(batch);
+  free(live.slots);
+  pthread_mutex_destroy(&stream.lock);
+  pthread_cond_destroy(&stream.cond);
+
+  stats->valid = 1;
+  stats->secs = (etv.tv_sec - stv.tv_sec) + 1E-6 * (etv.tv_usec - stv.tv_usec);
+  stats->used = max_total_size;
+  stats->total = mem_heappeak();
+  stats->util = (double)max_total_size / mem_heappeak();
+
+  mem_deinit();
+}
+
+/*********************************************************************
+ * Region self-check runs a fixed random workload against the region
+ * allocator, mixed with ordinary blocks. Every object gets a byte pattern
+ * that is checked when its region is destroyed or its block freed, so any
+ * overlap is caught even when range checks are off.
+ *********************************************************************/
+
+/* Object of the region self-check */
+typedef struct {
+  char *ptr;  /* payload address or NULL once released */
+  int size;   /* payload size */
+  int region; /* region holding the object or -1 for mm_malloc block */
+  int fill;   /* byte every payload byte is set to */
+} regobj_t;
+
+/* Check pattern of object and forget its range, returns 0 on corruption */
+static int region_release(const trace_t *trace, range_t **ranges,
+                          regobj_t *obj, int opnum) {
+  for (int i = 0; i < obj->size; i++) {
+    if ((unsigned char)obj->ptr[i] != obj->fill) {
+      malloc_error(trace, opnum, "Object %p of %s was overwritten at byte %d",
+                   obj->ptr, obj->region < 0 ? "heap" : "region", i);
+      return 0;
+    }
+  }
+  remove_range(ranges, obj->ptr);
+  obj->ptr = NULL;
+  return 1;
+}
+
+/*
+ * eval_mm_regions - Allocate REGION_OPS objects from REGION_COUNT regions
+ *    of different chunk sizes and from the heap, destroying and creating
+ *    regions again on the way. Objects are checked like trace blocks.
+ */
+static int eval_mm_regions(void) {
+  static const size_t chunks[REGION_COUNT] = {0, 1, 4096, 100000};
+  trace_t trace = {.filename = "regions"};
+  mm_region_t *regions[REGION_COUNT];
+  range_t *ranges = NULL;
+  regobj_t *objs;
+  unsigned seed = 1;
+  int nobjs = 0;
+  int valid = 1;
+
+  if (!(objs = calloc(REGION_OPS, sizeof(regobj_t))))
+    unix_error("calloc failed in eval_mm_regions");
+
+  mem_init();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_regions");
+  for (int r = 0; r < REGION_COUNT; r++)
+    if (!(regions[r] = mm_region_create(chunks[r])))
+      app_error("mm_region_create failed in eval_mm_regions");
+
+  for (int i = 0; i < REGION_OPS && valid; i++) {
+    int choice = rand_r(&seed) % 16;
+    int r = rand_r(&seed) % REGION_COUNT;
+
+    if (choice == 0) { /* destroy region r and start it anew */
+      for (int j = 0; j < nobjs && valid; j++)
+        if (objs[j].ptr != NULL && objs[j].region == r)
+          valid = region_release(&trace, &ranges, &objs[j], i);
+      mm_region_destroy(regions[r]);
+      if (!(regions[r] = mm_region_create(chunks[r])))
+        app_error("mm_region_create failed in eval_mm_regions");
+      continue;
+    }
+
+    if (choice == 1) { /* free some heap block */
+      regobj_t *obj = &objs[rand_r(&seed) % (nobjs + 1)];
+      if (obj->ptr != NULL && obj->region < 0) {
+        char *ptr = obj->ptr;
+        valid = region_release(&trace, &ranges, obj, i);
+        mm_free(ptr);
+      }
+      continue;
+    }
+
+    /* Large objects get chunks of their own in small-chunk regions */
+    regobj_t *obj = &objs[nobjs];
+    obj->size = 1 + rand_r(&seed) % (choice == 2 ? 50000 : 256);
+    obj->region = choice < 5 ? -1 : r;
+    obj->ptr = obj->region < 0 ? mm_malloc(obj->size)
+                               : mm_region_alloc(regions[r], obj->size);
+    if (obj->ptr == NULL) {
+      malloc_error(&trace, i, "%s failed.",
+                   obj->region < 0 ? "mm_malloc" : "mm_region_alloc");
+      valid = 0;
+      break;
+    }
+    if (add_range(&ranges, obj->ptr, obj->size, &trace, i, nobjs) == 0) {
+      valid = 0;
+      break;
+    }
+    obj->fill = (i * 7 + 1) & 0xff;
+    memset(obj->ptr, obj->fill, obj->size);
+    nobjs++;
+  }
+
+  for (int j = 0; j < nobjs && valid; j++) {
+    char *ptr = objs[j].ptr;
+    if (ptr != NULL && (valid = region_release(&trace, &ranges, &objs[j],
+                                               REGION_OPS)) &&
+        objs[j].region < 0)
+      mm_free(ptr);
+  }
+  for (int r = 0; r < REGION_COUNT; r++)
+    mm_region_destroy(regions[r]);
+  if (valid)
+    mm_checkheap(verbose);
+
+  clear_ranges(&ranges);
+  free(objs);
+  mem_deinit();
+  return valid;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -904,6 +2054,30 @@ static int eval_libc_valid(trace_t *trace) {
         }
         break;
 
+      case ALLOC_BATCH: /* one malloc per block */
+        for (int j = 0; j < trace->ops[i].count; j++) {
+          if ((p = malloc(trace->ops[i].size)) == NULL) {
+            malloc_error(trace, i, "libc malloc failed");
+            unix_error("System message");
+          }
+          trace->blocks[trace->ops[i].index + j] = p;
+        }
+        break;
+
+      case FREE_BATCH: /* one free per block */
+        for (int j = 0; j < trace->ops[i].count; j++)
+          free(trace->blocks[trace->ops[i].index + j]);
+        break;
+
+      case MEMALIGN: /* aligned_alloc */
+        p = aligned_alloc(trace->ops[i].count, trace->ops[i].size);
+        if (p == NULL) {
+          malloc_error(trace, i, "libc aligned_alloc failed");
+          unix_error("System message");
+        }
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
       default:
         app_error("invalid operation type  in eval_libc_valid");
     }
@@ -954,6 +2128,27 @@ static void eval_libc_speed(void *ptr) {
           free(0);
         }
         break;
+
+      case ALLOC_BATCH: /* one malloc per block */
+        index = trace->ops[i].index;
+        for (int j = 0; j < trace->ops[i].count; j++)
+          if ((trace->blocks[index + j] = malloc(trace->ops[i].size)) == NULL)
+            unix_error("malloc failed in eval_libc_speed");
+        break;
+
+      case FREE_BATCH: /* one free per block */
+        index = trace->ops[i].index;
+        for (int j = 0; j < trace->ops[i].count; j++)
+          free(trace->blocks[index + j]);
+        break;
+
+      case MEMALIGN: /* aligned_alloc */
+        index = trace->ops[i].index;
+        p = aligned_alloc(trace->ops[i].count, trace->ops[i].size);
+        if (p == NULL)
+          unix_error("aligned_alloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
     }
   }
 }
@@ -963,12 +2158,9 @@ static void eval_libc_speed(void *ptr) {
  ************************************/
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * printresult - prints a performance summary of one trace
  */
-static void printresults(stats_t *stats) {
-  /* Print the individual results for each trace */
-  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
-         "ops", "secs", "Kops", "trace");
+static void printresult(stats_t *stats) {
   if (!stats->valid) {
     printf("%2s%4s %6s%8s%10s%7s %s\n", stats->weight != 0 ? "*" : "", "no",
            "-", "-", "-", "-", stats->filename);
@@ -1014,6 +2206,148 @@ static void printresults(stats_t *stats) {
   printf(" %s\n", stats->filename);
 }
 
+/*
+ * printresults - prints a performance summary for some malloc package
+ */
+static void printresults(int n, stats_t *stats) {
+  /* Print the individual results for each trace */
+  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
+         "ops", "secs", "Kops", "trace");
+  for (int i = 0; i < n; i++)
+    printresult(&stats[i]);
+}
+
+/*
+ * printsummary - prints aggregates over all traces the same way grade.py
+ *    does for its trace list: utilization weighted by number of operations
+ *    (invalid traces count as 0%) and total utilization. Traces are counted
+ *    only in the columns printresult shows for their weight, so perf-only
+ *    traces are left out of utilization and util-only ones out of
+ *    throughput. Throughput is reported as time per operation, run mdriver
+ *    under callgrind to get instruction count.
+ */
+static void printsummary(int n, stats_t *stats) {
+  double ops = 0, util = 0, used = 0, total = 0, timed_ops = 0, secs = 0;
+
+  for (int i = 0; i < n; i++) {
+    int wutil = stats[i].weight != WPERF;
+    int wperf = stats[i].weight != WUTIL;
+    if (wutil)
+      ops += stats[i].ops;
+    if (!stats[i].valid)
+      continue;
+    if (wutil) {
+      util += stats[i].util * stats[i].ops;
+      used += stats[i].used;
+      total += stats[i].total;
+    }
+    if (wperf) {
+      timed_ops += stats[i].ops;
+      secs += stats[i].secs;
+    }
+  }
+
+  printf("\nWeighted memory utilization: %.1f%%\n",
+         ops > 0 ? 100.0 * util / ops : 0.0);
+  printf("Total memory utilization: %.2f%%\n",
+         total > 0 ? 100.0 * used / total : 0.0);
+  printf("Throughput: %.0f Kops, %.1f ns per operation\n",
+         secs > 0 ? timed_ops / 1e3 / secs : 0.0,
+         timed_ops > 0 ? secs * 1e9 / timed_ops : 0.0);
+}
+
+/*
+ * printresults_mt - prints the results of multi-threaded replay, scaling
+ *    efficiency compares aggregate throughput to nthreads times the
+ *    throughput of single-threaded run.
+ */
+static void printresults_mt(stats_t *stats) {
+  printf("\nReplay on %d threads:\n", stats->threads);
+  printf("  %6s%10s%10s%10s\n", "thread", "secs", "Kops", "ns/op");
+  for (int t = 0; t < stats->threads; t++) {
+    double secs = stats->thread_secs[t];
+    printf("  %6d%10.6f%10.0f%10.1f\n", t, secs, (stats->ops / 1e3) / secs,
+           secs * 1e9 / stats->ops);
+  }
+  double kops = stats->threads * (stats->ops / 1e3) / stats->mt_secs;
+  double single = (stats->ops / 1e3) / stats->secs;
+  printf("  %6s%10.6f%10.0f\n", "all", stats->mt_secs, kops);
+  printf("Scaling efficiency: %.1f%% of %d x single-threaded %.0f Kops\n",
+         100.0 * kops / (stats->threads * single), stats->threads, single);
+}
+
+/*
+ * printcounters - prints hardware events per request of the trace
+ */
+static void printcounters(const stats_t *stats) {
+  printf("\nHardware counters per request:\n");
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (stats->counts[i] < 0)
+      printf("  %-14s%10s\n", counters[i].name, "n/a");
+    else
+      printf("  %-14s%10.2f\n", counters[i].name, stats->counts[i]);
+  }
+  if (stats->counts[0] > 0 && stats->counts[1] > 0)
+    printf("  %-14s%10.2f\n", "IPC", stats->counts[0] / stats->counts[1]);
+}
+
+/*
+ * printlatency - prints percentiles of request latencies, measured when
+ *    replaying the trace with every request timed
+ */
+static void printlatency(const char *title, hist_t *hists) {
+  static const char *names[NUM_OPTYPES] = {
+    [ALLOC] = "malloc",         [FREE] = "free",
+    [REALLOC] = "realloc",      [ALLOC_BATCH] = "mbatch",
+    [FREE_BATCH] = "fbatch",    [MEMALIGN] = "memalign"};
+
+  printf("\n%s in ns:\n", title);
+  printf("  %-8s%10s%8s%8s%8s%10s\n", "request", "count", "p50", "p99",
+         "p99.9", "max");
+  for (int type = 0; type < NUM_OPTYPES; type++) {
+    hist_t *hist = &hists[type];
+    if (hist->n == 0)
+      continue;
+    printf("  %-8s%10lu%8lu%8lu%8lu%10lu\n", names[type], hist->n,
+           hist_percentile(hist, 0.5), hist_percentile(hist, 0.99),
+           hist_percentile(hist, 0.999), hist->max);
+  }
+}
+
+/*
+ * printstats - prints allocator statistics collected by the utilization run
+ */
+static void printstats(const mm_stats_t *heap) {
+  const mm_events_t *ev = &heap->events;
+
+  printf("\nAllocator state at peak heap size of %zu bytes:\n",
+         heap->heap_size);
+  if (heap->mapped_bytes > 0)
+    printf("  and %zu bytes of blocks mapped on their own\n",
+           heap->mapped_bytes);
+  printf("  used %zu bytes in %zu blocks, free %zu bytes in %zu blocks\n",
+         heap->used_bytes, heap->used_blocks, heap->free_bytes,
+         heap->free_blocks);
+  printf("  %-10s%10s%12s\n", "free list", "blocks", "bytes");
+  for (int i = 0; i < heap->lists; i++) {
+    if (heap->list[i].blocks == 0)
+      continue;
+    printf("  >= %-7zu%10zu%12zu\n", heap->list[i].min_size,
+           heap->list[i].blocks, heap->list[i].bytes);
+  }
+
+  printf("Allocator events:\n");
+  printf("  %zu free list searches, %.2f probes per search\n",
+         ev->fit_searches,
+         ev->fit_searches ? (double)ev->fit_probes / ev->fit_searches : 0.0);
+  printf("  %zu splits, %zu coalesces, %zu sbrk calls, %zu trims\n",
+         ev->splits, ev->coalesces, ev->sbrk_calls, ev->trims);
+  size_t reallocs = ev->realloc_inplace + ev->realloc_moved;
+  if (reallocs > 0)
+    printf("  %zu reallocs, %.1f%% in place\n", reallocs,
+           100.0 * ev->realloc_inplace / reallocs);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1054,13 +2388,23 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr,
+          "Usage: mdriver [-hlLpsSRVD] [-c <bin>] [-d <i>] [-v <i>] [-t <n>] "
+          "[-f <file>] [<file>...]\n");
   fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-c <bin>   Convert the trace to binary <bin> and exit.\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
   fprintf(stderr, "\t-l         Run libc malloc instead mm.\n");
+  fprintf(stderr, "\t-S         Stream traces while replaying them.\n");
+  fprintf(stderr, "\t-R         Check mm_region_* allocator and exit.\n");
+  fprintf(stderr, "\t-L         Print latency percentiles of requests.\n");
+  fprintf(stderr, "\t-p         Print hardware counters per request.\n");
+  fprintf(stderr, "\t-s         Print allocator statistics.\n");
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
-  fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+  fprintf(stderr, "\t-f <file>  Use <file> as a trace file, repeatable.\n");
+  fprintf(stderr, "\t           Directory means all *.rep files in it.\n");
+  fprintf(stderr, "\t-t <n>     Also replay <n> trace copies at once.\n");
 }
@@ -3,8 +3,10 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -16,55 +18,191 @@
 
 /* private variables */
 static unsigned char *heap;
-static unsigned char *mem_brk;
-static unsigned char *mem_max_addr;
+static unsigned char *mem_brk[MEM_REGIONS]; /* brk of every region */
+static size_t mem_size; /* sum of region sizes and mappings */
+static size_t mem_peak_size; /* highest mem_size since heap was reset */
+#if MEM_MAP_RATIO > 0
+static unsigned char *map_brk; /* end of mappings made by mem_map */
+#endif
+
+static size_t region_size; /* MAX_HEAP split between regions */
+
+/* Mappings of mem_map follow the regions */
+#define MAP_LO (heap + MEM_REGIONS * region_size)
+#define MAP_HI (MAP_LO + MEM_MAP_RATIO * MEM_REGIONS * region_size)
+
+#define MAP_FLAGS (MAP_PRIVATE | MAP_ANON | MAP_NORESERVE)
+
+#define HEAP_LENGTH ((1 + MEM_MAP_RATIO) * MEM_REGIONS * region_size)
+
+/*
+ * max_heap - heap size given by MM_MAX_HEAP, in bytes or with K, M or G
+ *    suffix, or MAX_HEAP if it's not set or invalid
+ */
+static size_t max_heap(void) {
+  const char *env = getenv("MM_MAX_HEAP");
+  if (env == NULL)
+    return MAX_HEAP;
+  char *end;
+  unsigned long long size = strtoull(env, &end, 10);
+  static const char units[] = "KMG";
+  const char *unit = *end != '\0' ? strchr(units, *end & ~0x20) : NULL;
+  int shift = unit != NULL ? 10 * (unit - units + 1) : 0;
+  end += unit != NULL;
+  if (end == env || *end != '\0' || size == 0 ||
+      size > (SIZE_MAX >> 1 >> shift)) {
+    fprintf(stderr, "Ignoring invalid MM_MAX_HEAP=%s\n", env);
+    return MAX_HEAP;
+  }
+  return size << shift;
+}
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
+  region_size = (max_heap() / MEM_REGIONS) & -MEM_ALIGN;
+  if (region_size > MEM_REGION_MAX)
+    region_size = MEM_REGION_MAX;
+  size_t slack = MEM_HUGEPAGES ? MEM_HUGEPAGE_SIZE : 0;
   heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
+              HEAP_LENGTH + slack,    /* length */
+              PROT_READ | PROT_WRITE, /* permissions */
+              MAP_FLAGS,              /* private or shared? */
               -1,                     /* fd */
               0);                     /* offset (dunno) */
-  mem_max_addr = heap + MAX_HEAP;
-  mem_brk = heap; /* heap is empty initially */
+  if (heap == MAP_FAILED) {
+    heap = NULL; /* every mem_sbrk fails */
+  } else if (MEM_HUGEPAGES) {
+    /* Cut the reservation down to huge page boundaries */
+    unsigned char *start = heap;
+    heap = (unsigned char *)(((uintptr_t)start + slack - 1) & -slack);
+    if (heap > start)
+      munmap(start, heap - start);
+    munmap(heap + HEAP_LENGTH, start + slack - heap);
+    madvise(heap, HEAP_LENGTH, MADV_HUGEPAGE);
+  }
+  mem_reset_brk(); /* heap is empty initially */
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  munmap(heap, MAX_HEAP);
+  munmap(heap, HEAP_LENGTH);
 }
 
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk() {
-  mem_brk = heap;
+  for (int i = 0; i < MEM_REGIONS; i++)
+    mem_brk[i] = mem_region_lo(i);
+#if MEM_MAP_RATIO > 0
+  /* Mapped blocks always start out zeroed */
+  if (heap != NULL && map_brk > MAP_LO)
+    madvise(MAP_LO, map_brk - MAP_LO, MADV_DONTNEED);
+  map_brk = MAP_LO;
+#endif
+  mem_size = 0;
+  mem_peak_size = 0;
+}
+
+/*
+ * mem_account - add incr bytes to the heap size and track its peak
+ */
+static void mem_account(long incr) {
+  size_t size = __atomic_add_fetch(&mem_size, incr, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&mem_peak_size, __ATOMIC_RELAXED);
+  while (size > peak &&
+         !__atomic_compare_exchange_n(&mem_peak_size, &peak, size, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap can be shrunk only with mem_trim.
  */
 void *mem_sbrk(long incr) {
-  unsigned char *old_brk = mem_brk;
+  return mem_sbrk_region(0, incr);
+}
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+/*
+ * mem_trim - shrinks the heap by decr bytes. Whole pages that are no
+ *    longer part of the heap are given back to the operating system.
+ */
+int mem_trim(long decr) {
+  return mem_trim_region(0, decr);
+}
+
+/*
+ * mem_sbrk_region - mem_sbrk for given region. Regions are grown by
+ *    one thread at a time each, so only shared counters are atomic.
+ */
+void *mem_sbrk_region(int region, long incr) {
+  unsigned char *old_brk = mem_brk[region];
+  unsigned char *max_addr = (unsigned char *)mem_region_lo(region) +
+                            region_size;
+
+  if (heap == NULL || (incr < 0) || ((old_brk + incr) > max_addr)) {
     errno = ENOMEM;
+#ifdef DRIVER
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+#endif
     return (void *)-1;
   }
 
-  mem_brk += incr;
+  mem_brk[region] += incr;
+  mem_account(incr);
   return (void *)old_brk;
 }
 
+/*
+ * mem_trim_region - mem_trim for given region
+ */
+int mem_trim_region(int region, long decr) {
+  unsigned char *lo = mem_region_lo(region);
+  unsigned char *old_brk = mem_brk[region];
+
+  if ((decr < 0) || ((old_brk - decr) < lo)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  mem_brk[region] -= decr;
+  mem_account(-decr);
+
+  /* Dropping a part of huge page would split it */
+  size_t pagesize = MEM_HUGEPAGES ? MEM_HUGEPAGE_SIZE : mem_pagesize();
+  size_t keep = (mem_brk[region] - lo + pagesize - 1) / pagesize * pagesize;
+  if (lo + keep < old_brk)
+    madvise(lo + keep, old_brk - (lo + keep), MADV_DONTNEED);
+  return 0;
+}
+
+/*
+ * mem_region_lo - return address of the first byte of given region
+ */
+void *mem_region_lo(int region) {
+  return (void *)(heap + region * region_size);
+}
+
+/*
+ * mem_region_heapsize - returns the size of given region in bytes
+ */
+size_t mem_region_heapsize(int region) {
+  return (size_t)(mem_brk[region] - (unsigned char *)mem_region_lo(region));
+}
+
+/*
+ * mem_region - returns the region given heap address belongs to
+ */
+int mem_region(void *addr) {
+  return ((unsigned char *)addr - heap) / region_size;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -72,18 +210,124 @@ void *mem_heap_lo() {
   return (void *)heap;
 }
 
+/*
+ * mem_map - give a separate page aligned area of size bytes (multiple of
+ *    page size), filled with zeros. Returns (void *)-1 if there's no room.
+ */
+#if MEM_MAP_RATIO > 0
+void *mem_map(size_t size) {
+  unsigned char *brk = __atomic_load_n(&map_brk, __ATOMIC_RELAXED);
+  unsigned char *addr;
+  do {
+    /* Mappings that can hold a huge page start on its boundary */
+    addr = brk;
+    if (MEM_HUGEPAGES && size >= MEM_HUGEPAGE_SIZE)
+      addr = (unsigned char *)(((uintptr_t)brk + MEM_HUGEPAGE_SIZE - 1) &
+                               -MEM_HUGEPAGE_SIZE);
+    if (heap == NULL || addr > MAP_HI || size > (size_t)(MAP_HI - addr)) {
+      errno = ENOMEM;
+      return (void *)-1;
+    }
+  } while (!__atomic_compare_exchange_n(&map_brk, &brk, addr + size, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  mem_account(size);
+  return addr;
+}
+
+/*
+ * mem_unmap - give back an area made by mem_map. Its pages are dropped
+ *    right away, address space is reused after mem_reset_brk.
+ */
+void mem_unmap(void *addr, size_t size) {
+  madvise(addr, size, MADV_DONTNEED);
+  mem_account(-size);
+}
+
+/*
+ * mem_remap - resize an area made by mem_map without copying its contents.
+ *    The last area just moves the end of mappings, others are moved to
+ *    fresh address space by the page tables. Returns (void *)-1 on failure.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+  unsigned char *old = addr;
+  if (new_size <= old_size) {
+    madvise(old + new_size, old_size - new_size, MADV_DONTNEED);
+    mem_account(new_size - old_size);
+    return addr;
+  }
+  unsigned char *end = old + old_size;
+  if (new_size - old_size <= (size_t)(MAP_HI - end) &&
+      __atomic_compare_exchange_n(&map_brk, &end, old + new_size, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    mem_account(new_size - old_size);
+    return addr;
+  }
+  unsigned char *new = mem_map(new_size);
+  if (new == (void *)-1)
+    return new;
+  if (mremap(old, old_size, new_size, MREMAP_MAYMOVE | MREMAP_FIXED, new) ==
+      MAP_FAILED) {
+    mem_unmap(new, new_size);
+    return (void *)-1;
+  }
+  /* Keep the address space left behind reserved */
+  mmap(old, old_size, PROT_READ | PROT_WRITE, MAP_FLAGS | MAP_FIXED, -1, 0);
+  mem_account(-old_size);
+  return new;
+}
+#else
+void *mem_map(size_t size) {
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_FLAGS, -1, 0);
+  if (addr == MAP_FAILED)
+    return (void *)-1;
+  if (MEM_HUGEPAGES && size >= MEM_HUGEPAGE_SIZE)
+    madvise(addr, size, MADV_HUGEPAGE);
+  mem_account(size);
+  return addr;
+}
+
+void mem_unmap(void *addr, size_t size) {
+  munmap(addr, size);
+  mem_account(-size);
+}
+
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+  void *new = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  if (new == MAP_FAILED)
+    return (void *)-1;
+  if (MEM_HUGEPAGES && new_size >= MEM_HUGEPAGE_SIZE)
+    madvise(new, new_size, MADV_HUGEPAGE);
+  mem_account(new_size - old_size);
+  return new;
+}
+#endif
+
 /*
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi() {
-  return (void *)(mem_brk - 1);
+#if MEM_MAP_RATIO > 0
+  if (map_brk > MAP_LO)
+    return (void *)(map_brk - 1);
+#endif
+  int region = MEM_REGIONS - 1;
+  while (region > 0 && mem_region_heapsize(region) == 0)
+    region--;
+  return (void *)(mem_brk[region] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over regions
  */
 size_t mem_heapsize() {
-  return (size_t)((void *)mem_brk - (void *)heap);
+  return mem_size;
+}
+
+/*
+ * mem_heappeak() - returns the largest heap size in bytes since last reset
+ */
+size_t mem_heappeak() {
+  return mem_peak_size;
 }
 
 /*
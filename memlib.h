@@ -8,15 +8,74 @@
 #define ALIGNMENT 16
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, all of it is reserved by mem_init. May be
+ * changed at run time with MM_MAX_HEAP environment variable, e.g. 64G.
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (100 * (1 << 20)) /* 100 MB */
+#endif
+
+/*
+ * Number of regions with separate brk pointers the heap is split into,
+ * a multi-arena allocator grows every arena in its own region
+ */
+#ifndef MEM_REGIONS
+#ifdef ARENAS
+#define MEM_REGIONS ARENAS
+#else
+#define MEM_REGIONS 1
+#endif
+#endif
+
+/*
+ * With MEM_HUGEPAGES=1 the heap is laid out for transparent huge pages:
+ * reservation and regions are aligned to MEM_HUGEPAGE_SIZE and advised with
+ * MADV_HUGEPAGE, so the kernel backs the heap in huge pages as it grows, and
+ * trimming gives back only whole huge pages.
+ */
+#ifndef MEM_HUGEPAGES
+#define MEM_HUGEPAGES 0
+#endif
+#define MEM_HUGEPAGE_SIZE (1L << 21)
+#define MEM_ALIGN (MEM_HUGEPAGES ? MEM_HUGEPAGE_SIZE : (1L << 16))
+
+/*
+ * Largest region, allocators may link blocks by 32-bit word offsets
+ */
+#ifndef MEM_REGION_MAX
+#define MEM_REGION_MAX (1L << 33)
+#endif
+
+/*
+ * Address space reserved past the regions for blocks mapped on their own
+ * with mem_map, as a multiple of the heap size, so that they are part of
+ * the heap. With 0 such blocks get ordinary mappings of the operating system.
+ */
+#ifndef MEM_MAP_RATIO
+#ifdef DRIVER
+#define MEM_MAP_RATIO 16
+#else
+#define MEM_MAP_RATIO 0
+#endif
+#endif
 
 void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(long incr);
+int mem_trim(long decr);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heappeak(void);
 size_t mem_pagesize(void);
+
+void *mem_sbrk_region(int region, long incr);
+int mem_trim_region(int region, long decr);
+void *mem_region_lo(int region);
+size_t mem_region_heapsize(int region);
+int mem_region(void *addr);
+
+void *mem_map(size_t size);
+void mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
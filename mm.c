@@ -1,12 +1,13 @@
 /*
  * Author: Daniel Marczak (324351)
- * mm.c - Implementation using LIFO, boundertags,
+ * mm.c - Implementation using segregated LIFO lists, optimized boundertags,
  * best-fit strategies and optimized realloc.
  *
  * Solution based on lecture presentation,
  * CSAPP book and solution template from mm-implicit.c file.
  */
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +18,41 @@
 
 #include "mm.h"
 #include "memlib.h"
+#include "capture.h"
+
+/* Thread-safe build: -DTHREADS=1 puts the heap behind a single lock and
+ * gives every thread a cache of up to TCACHE_COUNT freed blocks for each
+ * block size up to TCACHE_MAX bytes. The lock is taken only when the cache
+ * can't serve the request. */
+#ifndef THREADS
+#define THREADS 0
+#endif
+#if THREADS
+#include <pthread.h>
+#endif
+
+/* Multi-arena build: -DARENAS=<n> splits the heap into n arenas, each with
+ * its own lock, free lists and memlib region. Threads are given arenas
+ * round-robin and fall back to the other arenas once theirs is full. Block
+ * is always freed to the arena whose region holds its address. Threads of
+ * other arenas don't take its lock for that, they push the block on lock-free
+ * remote list of the owner, which is drained whenever the owner is locked. */
+#ifndef ARENAS
+#define ARENAS 1
+#endif
+#if ARENAS > 1 && !THREADS
+#error "Arenas need -DTHREADS=1"
+#endif
+#if !defined(DRIVER) && !THREADS
+#error "Interposed allocator needs -DTHREADS=1"
+#endif
+
+/* Thread-local state is reached without calls into the dynamic linker, and
+ * also in a shared library loaded with LD_PRELOAD. */
+#define __tls __thread __attribute__((tls_model("initial-exec")))
+#if ARENAS > MEM_REGIONS
+#error "Every arena needs its own memlib region"
+#endif
 
 /* If you want debugging output, use the following macro.
  * When you hand in, remove the #define DEBUG line. */
@@ -38,24 +74,187 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif /* !DRIVER */
 
 typedef int32_t word_t; /* Heap is bascially an array of 4-byte words. */
 
+/* Number of segregated size classes. Class k keeps free blocks of size
+ * [16 * 2^k, 16 * 2^(k+1)) and the last class keeps everything above.
+ * Classes from SEG_SPLIT_BITS upwards are split into 2^SEG_SPLIT_BITS
+ * free lists of equal size range (two-level segregated fit), so search
+ * within a list never walks blocks much smaller than requested.
+ * Building with -DSEG_CLASSES=1 gives back a single LIFO list. */
+#ifndef SEG_CLASSES
+#define SEG_CLASSES 16
+#endif
+#ifndef SEG_SPLIT_BITS
+#define SEG_SPLIT_BITS (SEG_CLASSES > 2 ? 2 : 0)
+#endif
+#define SEG_LISTS                                                              \
+  (SEG_SPLIT_BITS + ((SEG_CLASSES - SEG_SPLIT_BITS) << SEG_SPLIT_BITS))
+#if SEG_CLASSES <= SEG_SPLIT_BITS || SEG_LISTS > 64
+#error "Free lists must fit in 64-bit bitmap"
+#endif
+
+/* Search policy of find_fit, select with -DFIT_POLICY=<policy>. */
+#define FIT_FIRST 0   /* First block that is large enough */
+#define FIT_BEST 1    /* Smallest block, stops early on exact match */
+#define FIT_BOUNDED 2 /* Smallest of first FIT_CANDIDATES fitting blocks */
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_BEST
+#endif
+#ifndef FIT_CANDIDATES
+#define FIT_CANDIDATES 8
+#endif
+/* Walk of the free list holding request size gives up after FIT_SCAN_MAX
+ * blocks, 0 walks the whole list. */
+#ifndef FIT_SCAN_MAX
+#define FIT_SCAN_MAX (SEG_CLASSES > 1 ? 64 : 0)
+#endif
+
+/* Free lists of up to FIT_INDEX blocks are mirrored in per-class arrays of
+ * block sizes searched by find_fit instead of the list. 0 turns it off. */
+#ifndef FIT_INDEX
+#define FIT_INDEX 0
+#endif
+
+/* Blocks up to SLAB_MAX bytes are carved out of SLAB_SIZE byte slabs with
+ * one slab list per block size. Building with -DSLAB_MAX=0 disables it. */
+#ifndef SLAB_MAX
+#define SLAB_MAX 64
+#endif
+#ifndef SLAB_SIZE
+#define SLAB_SIZE 1024
+#endif
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+
+/* Deferred coalescing: freed blocks up to QUICK_MAX bytes are kept intact on
+ * per-size quick lists and get coalesced in one pass only when find_fit
+ * fails. Disabled by default, enable with e.g. -DQUICK_MAX=512. */
+#ifndef QUICK_MAX
+#define QUICK_MAX 0
+#endif
+#define QUICK_CLASSES                                                          \
+  (QUICK_MAX > SLAB_MAX ? (QUICK_MAX - SLAB_MAX) / ALIGNMENT : 0)
+
+/* Heap growth policy: heap is extended at least by GROW_MIN bytes and by
+ * GROW_RATIO percent of its current size. With GROW_SHORTFALL free last
+ * block is extended only by the missing part of the request. */
+#ifndef GROW_MIN
+#define GROW_MIN 0
+#endif
+#ifndef GROW_RATIO
+#define GROW_RATIO 0
+#endif
+#ifndef GROW_SHORTFALL
+#define GROW_SHORTFALL 1
+#endif
+
+/* Block grown by realloc more than once gets REALLOC_HEADROOM percent of its
+ * size reserved as a free block right after it, whenever it has to be moved
+ * or the heap has to be extended. Next growth just takes space from there.
+ * The headroom is an ordinary free block, so heap size shows real cost.
+ * Disabled by default, traces in traces/ lose utilization with it. */
+#ifndef REALLOC_HEADROOM
+#define REALLOC_HEADROOM 0
+#endif
+
+/* Free last block larger than TRIM_THRESHOLD bytes gets cut down to about
+ * TRIM_PAD bytes ending at page boundary and the rest is given back with
+ * mem_trim. Padding keeps heap from shrinking and growing back on every
+ * free & malloc pair. Disabled by default, since returning memory to the
+ * operating system costs page faults after the heap grows back. */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD (256 * 1024)
+#endif
+
+/* Requests of at least MMAP_THRESHOLD bytes get a memlib mapping of their
+ * own instead of heap space. Free gives the pages back right away and
+ * realloc resizes the mapping without copying. Disabled by default, page
+ * rounding costs utilization on traces in traces/. */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD 0
+#endif
+
+/* Free blocks larger than a boundary tag can hold (2GiB) get 64-bit size
+ * fields, so that arenas may grow past that and be freed up as a whole.
+ * Used blocks never get that large, requests above MAX_REQUEST are mapped
+ * on their own. Disabled by default, it slows down every size lookup and
+ * without it arenas just stop growing at 2GiB. */
+#ifndef LARGE_BLOCKS
+#define LARGE_BLOCKS 0
+#endif
+
+#ifndef TCACHE_MAX
+#define TCACHE_MAX (THREADS ? 512 : 0)
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 16
+#endif
+#define TCACHE_CLASSES (TCACHE_MAX / ALIGNMENT)
+#if TCACHE_MAX > 0 && !THREADS
+#error "Thread caches need -DTHREADS=1"
+#endif
+
 typedef enum {
-  FREE = 0, /* Block is free */
-  USED = 1, /* Block is used */
+  FREE = 0,     /* Block is free */
+  USED = 1,     /* Block is used */
+  PREVFREE = 2, /* Previous block is free (optimized boundary tags) */
+  SLAB = 4,     /* Block is a slot inside of a slab */
+  GROWN = 8,    /* Used block has been grown by realloc */
+  MMAPPED = SLAB | GROWN, /* Block is a mapping of its own, slots never grow */
+  LARGE = GROWN,          /* Free block has 64-bit size, see bt_large */
 } bt_flags;
 
-static word_t *heap_start;    /* Address of the first block */
-static word_t *bt_heap_last;  /* Boundery tag of the last block */
-static word_t *bt_heap_start; /* Boundary tag of the first block */
+/* Heap state. In multi-arena build every arena keeps it at the start of its
+ * region and each thread points arena at the one it's working on. */
+typedef struct {
+  word_t *heap_start;   /* Address of the first block */
+  word_t *bt_heap_last; /* Boundery tag of the last block */
+  word_t *seg_start;    /* List head of the first free list */
+  int region;           /* Memlib region holding the arena */
+  mm_events_t events;   /* Counters reported by mm_stats */
+#if THREADS
+  pthread_mutex_t lock;
+#endif
+#if ARENAS > 1
+  void *remote; /* Blocks freed by threads of other arenas */
+#endif
+} arena_t;
+
+#if ARENAS > 1
+static __tls arena_t *arena;
+#else
+static arena_t arena[1];
+#endif
+#if THREADS
+static unsigned heap_epoch; /* Incremented by every mm_init */
+#endif
 
 /* --=[ boundary tag handling ]=-------------------------------------------- */
 
+/* Largest block size stored in a boundary tag. */
+#define TAG_MAX ((size_t)INT32_MAX & -ALIGNMENT)
+
+/* Free block larger than TAG_MAX has LARGE flag in its tags, which is never
+ * set on other free blocks. Header is followed by LIFO links and 64-bit
+ * size, footer is preceded by another copy of the size. */
+static inline int bt_large(word_t *bt) {
+  return LARGE_BLOCKS && (*bt & (USED | LARGE)) == LARGE;
+}
+
 /* Given boundary tag address calculate the block size in bytes*/
-static inline word_t bt_size(word_t *bt) {
-  return *bt & ~(USED);
+static inline size_t bt_size(word_t *bt) {
+  if (bt_large(bt)) {
+    return *(uint64_t *)(bt + 3);
+  }
+  return *bt & ~(USED | PREVFREE | SLAB | GROWN);
 }
 
 /* Given boundary tag address returns whether the block is in use */
@@ -80,7 +279,37 @@ static inline word_t *bt_fromptr(void *ptr) {
 
 /* Creates boundary tag(s) for given block. */
 static inline void bt_make(word_t *bt, size_t size, bt_flags flags) {
-  *bt = ((word_t)size) | flags;
+  if (LARGE_BLOCKS && size > TAG_MAX) {
+    *bt = LARGE | flags;
+    *(uint64_t *)(bt + 3) = size;
+  } else {
+    *bt = ((word_t)size) | flags;
+  }
+}
+
+/* Creates footer of free block, its header has to be made first. */
+static inline void bt_make_footer(word_t *bt, size_t size) {
+  word_t *footer = bt_footer(bt);
+  if (LARGE_BLOCKS && size > TAG_MAX) {
+    *footer = LARGE;
+    *(uint64_t *)(footer - 2) = size;
+  } else {
+    *footer = size;
+  }
+}
+
+/* Previous block free flag handling for optimized boundary tags. */
+static inline bt_flags bt_get_prevfree(word_t *bt) {
+  return *bt & PREVFREE;
+}
+
+static inline void bt_clr_prevfree(word_t *bt) {
+  if (bt)
+    *bt &= ~PREVFREE;
+}
+
+static inline void bt_set_prevfree(word_t *bt) {
+  *bt |= PREVFREE;
 }
 
 /* Returns address of payload. */
@@ -96,12 +325,33 @@ static inline word_t *bt_next(word_t *bt) {
   return (word_t *)(bt + (bt_size(bt) / 4));
 }
 
-/* Returns address of previous block or NULL. */
+/* Returns address of previous block or NULL. Only free blocks have footer,
+ * so it's valid only when PREVFREE flag is set. */
 static inline word_t *bt_prev(word_t *bt) {
-  if (bt_payload(bt) == bt_fromptr(heap_start)) {
+  if (bt_payload(bt) == bt_fromptr(arena->heap_start)) {
     return NULL;
   }
-  return (word_t *)(bt - (bt_size(bt - 1) / 4));
+  word_t *footer = bt - 1;
+  if (bt_large(footer)) {
+    return bt - *(uint64_t *)(footer - 2) / 4;
+  }
+  return (word_t *)(bt - (bt_size(footer) / 4));
+}
+
+/* Returns address of block following bt or NULL if bt is the last one. */
+static inline word_t *bt_succ(word_t *bt) {
+  return bt == arena->bt_heap_last ? NULL : bt_next(bt);
+}
+
+/* --=[ miscellanous procedures ]=------------------------------------------ */
+
+/* Largest request whose block size still fits in a boundary tag. */
+#define MAX_REQUEST ((size_t)INT32_MAX - 2 * ALIGNMENT)
+
+/* Calculates block size incl. header & payload,
+ * and aligns it to block boundary (ALIGNMENT). */
+static inline size_t blksz(size_t size) {
+  return (size + sizeof(word_t) + ALIGNMENT - 1) & -ALIGNMENT;
 }
 
 /* --=[ LIFO handling ]=----------------------------------------------------- */
@@ -169,123 +419,312 @@ static void lifo_connect(word_t *current_bt, word_t *next_bt) {
   lifo_create_prev(next_bt, current_bt);
 }
 
-/* Put block to LIFO */
-static void lifo_add(word_t *current_bt) {
-  word_t *next_bt = lifo_next(bt_heap_start);
+/* Given block size returns index of its free list */
+static inline int seg_class(size_t size) {
+  unsigned granules = size / ALIGNMENT;
+  int cls = 31 - __builtin_clz(granules);
+  if (cls < SEG_SPLIT_BITS) {
+    return cls;
+  }
+  if (cls >= SEG_CLASSES) {
+    return SEG_LISTS - 1;
+  }
+  int sub = (granules >> (cls - SEG_SPLIT_BITS)) & ((1 << SEG_SPLIT_BITS) - 1);
+  return SEG_SPLIT_BITS + ((cls - SEG_SPLIT_BITS) << SEG_SPLIT_BITS) + sub;
+}
+
+/* Returns list head of given free list. Heads live in the heap prologue.
+ * Neither boundary tag nor previous pointer of a head is ever accessed, so
+ * heads are packed one word apart and prologue stores only next fields. */
+static inline word_t *seg_head(int cls) {
+  return arena->seg_start + cls;
+}
+
+/* Bitmap of non-empty free lists precedes list heads in the prologue. */
+static inline uint64_t *seg_bitmap(void) {
+  return (uint64_t *)(arena->seg_start - 1);
+}
+
+/* Given LIFO element returns index of free list it heads or -1 */
+static inline int seg_index(word_t *bt) {
+  if (bt < arena->seg_start || bt >= seg_head(SEG_LISTS)) {
+    return -1;
+  }
+  return bt - arena->seg_start;
+}
+
+#if FIT_INDEX > 0
+/* Index of a free list keeps sizes and offsets of its blocks in separate
+ * arrays, so that fit checks scan consecutive sizes rather than follow links
+ * to random heap addresses. It falls out of date once the list outgrows it
+ * and is rebuilt when the list shrinks back to half of the index. */
+typedef struct {
+  int32_t length;             /* blocks on the list */
+  int32_t count;              /* blocks in the index or -1 if out of date */
+  uint32_t size[FIT_INDEX];   /* block sizes, saturated at UINT32_MAX */
+  uint32_t offset[FIT_INDEX]; /* word offsets of blocks from seg_start */
+} fit_index_t;
+
+#define FIT_INDEX_WORDS (SEG_LISTS * sizeof(fit_index_t) / sizeof(word_t))
+
+/* Indexes follow the list heads in the prologue. */
+static inline fit_index_t *fit_index(int cls) {
+  word_t *end = arena->seg_start + SEG_LISTS + SLAB_CLASSES + QUICK_CLASSES;
+  return (fit_index_t *)(end + 1) + cls;
+}
+
+static inline word_t *fit_index_block(fit_index_t *index, int i) {
+  return arena->seg_start + index->offset[i];
+}
+
+static inline void fit_index_put(fit_index_t *index, word_t *bt) {
+  size_t size = bt_size(bt);
+  index->size[index->count] = size < UINT32_MAX ? size : UINT32_MAX;
+  index->offset[index->count++] = bt - arena->seg_start;
+}
+
+static void fit_index_add(int cls, word_t *bt) {
+  fit_index_t *index = fit_index(cls);
+  index->length++;
+  if (index->count == FIT_INDEX) {
+    index->count = -1;
+  } else if (index->count >= 0) {
+    fit_index_put(index, bt);
+  }
+}
+
+/* Called after bt has been taken off the list of class cls */
+static void fit_index_remove(int cls, word_t *bt) {
+  fit_index_t *index = fit_index(cls);
+  index->length--;
+  if (index->count > 0) {
+    uint32_t offset = bt - arena->seg_start;
+    int i = 0;
+    while (index->offset[i] != offset) {
+      i++;
+    }
+    index->count--;
+    index->size[i] = index->size[index->count];
+    index->offset[i] = index->offset[index->count];
+  } else if (index->count < 0 && index->length <= FIT_INDEX / 2) {
+    index->count = 0;
+    for (word_t *next_bt = lifo_next(seg_head(cls)); lifo_next(next_bt);
+         next_bt = lifo_next(next_bt)) {
+      fit_index_put(index, next_bt);
+    }
+  }
+}
+#else
+#define FIT_INDEX_WORDS 0
+#endif
+
+/* Put block to LIFO right after given head */
+static void lifo_push(word_t *head, word_t *current_bt) {
+  word_t *next_bt = lifo_next(head);
   lifo_create_next(current_bt, next_bt);
-  lifo_create_prev(current_bt, bt_heap_start);
-  lifo_create_next(bt_heap_start, current_bt);
+  lifo_create_prev(current_bt, head);
+  lifo_create_next(head, current_bt);
   lifo_create_prev(next_bt, current_bt);
+  int cls = seg_index(head);
+  if (cls >= 0) {
+    *seg_bitmap() |= 1ULL << cls;
+#if FIT_INDEX > 0
+    fit_index_add(cls, current_bt);
+#endif
+  }
+}
+
+/* Put block to LIFO of its size class */
+static void lifo_add(word_t *current_bt) {
+  lifo_push(seg_head(seg_class(bt_size(current_bt))), current_bt);
+}
+
+/* Take block out of its LIFO */
+static inline void lifo_remove(word_t *current_bt) {
+  word_t *prev_bt = lifo_prev(current_bt);
+  word_t *next_bt = lifo_next(current_bt);
+  lifo_connect(prev_bt, next_bt);
+  int cls = seg_index(prev_bt);
+  if (cls >= 0 && lifo_next(next_bt) == NULL) {
+    *seg_bitmap() &= ~(1ULL << cls);
+  }
+#if FIT_INDEX > 0
+  /* Slabs share the links, but only free blocks are on free lists */
+  if (bt_free(current_bt)) {
+    fit_index_remove(seg_class(bt_size(current_bt)), current_bt);
+  }
+#endif
 }
 
 /* --=[ mm_init ]=---------------------------------------------------------- */
 
-/* Coalesce free blocks. */
+/* Coalesce free blocks. Writes boundary tags of the resulting free block
+ * and marks it as free in the header of its successor. */
 static void *coalesce(void *ptr) {
   word_t *current_bt = bt_fromptr(ptr);
-  word_t *prev_bt = bt_prev(current_bt);
-  word_t *next_bt = bt_next(current_bt);
+  word_t *next_bt = bt_succ(current_bt);
+  int prev_used = !bt_get_prevfree(current_bt);
+  int next_used = next_bt == NULL || bt_used(next_bt);
 
   size_t size = bt_size(current_bt);
   /* Case 1 */
-  if (bt_used(prev_bt) && (bt_heap_last == current_bt || bt_used(next_bt))) {
+  if (prev_used && next_used) {
+    bt_make(current_bt, size, FREE);
+    bt_make_footer(current_bt, size);
     lifo_add(current_bt);
-    return ptr;
   }
   /* Case 2 */
-  else if (bt_used(prev_bt) &&
-           (bt_heap_last != current_bt && bt_free(next_bt))) {
+  else if (prev_used && !next_used) {
+    arena->events.coalesces++;
     size += bt_size(next_bt);
-    lifo_connect(lifo_prev(next_bt), lifo_next(next_bt));
+    lifo_remove(next_bt);
     bt_make(current_bt, size, FREE);
-    bt_make(bt_footer(current_bt), size, FREE);
+    bt_make_footer(current_bt, size);
     lifo_add(current_bt);
-    if (bt_heap_last == next_bt) {
-      bt_heap_last = current_bt;
+    if (arena->bt_heap_last == next_bt) {
+      arena->bt_heap_last = current_bt;
     }
   }
   /* Case 3 */
-  else if (bt_free(prev_bt) &&
-           (bt_heap_last == current_bt || bt_used(next_bt))) {
+  else if (!prev_used && next_used) {
+    arena->events.coalesces++;
+    word_t *prev_bt = bt_prev(current_bt);
     size += bt_size(prev_bt);
-    lifo_connect(lifo_prev(prev_bt), lifo_next(prev_bt));
-    bt_make(bt_footer(current_bt), size, FREE);
+    lifo_remove(prev_bt);
     bt_make(prev_bt, size, FREE);
+    bt_make_footer(prev_bt, size);
     lifo_add(prev_bt);
     ptr = bt_payload(prev_bt);
-    if (bt_heap_last == current_bt) {
-      bt_heap_last = prev_bt;
+    if (arena->bt_heap_last == current_bt) {
+      arena->bt_heap_last = prev_bt;
     }
   }
   /* Case 4 */
   else {
+    arena->events.coalesces += 2;
+    word_t *prev_bt = bt_prev(current_bt);
     size += bt_size(prev_bt) + bt_size(next_bt);
-    lifo_connect(lifo_prev(prev_bt), lifo_next(prev_bt));
-    lifo_connect(lifo_prev(next_bt), lifo_next(next_bt));
+    lifo_remove(prev_bt);
+    lifo_remove(next_bt);
     bt_make(prev_bt, size, FREE);
-    bt_make(bt_footer(next_bt), size, FREE);
+    bt_make_footer(prev_bt, size);
     lifo_add(prev_bt);
     ptr = bt_payload(prev_bt);
-    if (bt_heap_last == next_bt) {
-      bt_heap_last = prev_bt;
+    if (arena->bt_heap_last == next_bt) {
+      arena->bt_heap_last = prev_bt;
     }
   }
+  next_bt = bt_succ(bt_fromptr(ptr));
+  if (next_bt != NULL) {
+    bt_set_prevfree(next_bt);
+  }
   return ptr;
 }
 
-int mm_init(void) {
-  /* Create the initial empty heap */
-  if ((heap_start = mem_sbrk(12 * sizeof(word_t))) == (void *)-1) {
+/* Number of words preceding the first block: free list bitmap, heads of free,
+ * slab and quick lists, free list indexes, padding and sentinel block,
+ * rounded up so that first payload is aligned. */
+#define PROLOGUE_WORDS                                                         \
+  ((2 + SEG_LISTS + SLAB_CLASSES + QUICK_CLASSES + FIT_INDEX_WORDS + 5 + 3) & \
+   ~3)
+
+/* Words of arena state preceding the prologue in multi-arena build. */
+#define ARENA_WORDS                                                            \
+  (ARENAS > 1 ? (sizeof(arena_t) + ALIGNMENT - 1) / ALIGNMENT * 4 : 0)
+
+/* Create an empty heap in given memlib region and make it current arena. */
+static int arena_init(int region) {
+  word_t *start = mem_sbrk_region(
+    region, (ARENA_WORDS + PROLOGUE_WORDS) * sizeof(word_t));
+  if (start == (void *)-1) {
     return -1;
   }
+#if ARENAS > 1
+  arena = (arena_t *)start;
+#endif
+  arena->region = region;
+  arena->heap_start = start + ARENA_WORDS;
+  memset(&arena->events, 0, sizeof(mm_events_t));
+#if THREADS
+  pthread_mutex_init(&arena->lock, NULL);
+#endif
+#if ARENAS > 1
+  arena->remote = NULL;
+#endif
+
+  /* Empty list heads of all size classes and slabs */
+  arena->seg_start = arena->heap_start + 1;
+  *seg_bitmap() = 0;
+
+  /* Sentinel block ending every LIFO, it also guards the first block from
+   * being coalesced with the prologue */
+  word_t *sentinel = arena->heap_start + PROLOGUE_WORDS - 5;
+  bt_make(sentinel, ALIGNMENT, USED);     /* Header of sentinel */
+  bt_make(sentinel + 3, ALIGNMENT, USED); /* Footer of sentinel */
+  lifo_put_next(sentinel, 0); /* Sentinel don't have next block in LIFO */
+  for (int cls = 0; cls < SEG_LISTS + SLAB_CLASSES; cls++) {
+    lifo_connect(seg_head(cls), sentinel);
+  }
+  for (int cls = 0; cls < QUICK_CLASSES; cls++) {
+    lifo_put_next(seg_head(SEG_LISTS + SLAB_CLASSES + cls), 0);
+  }
+#if FIT_INDEX > 0
+  memset(fit_index(0), 0, SEG_LISTS * sizeof(fit_index_t));
+#endif
+
+  arena->heap_start += PROLOGUE_WORDS;
+  arena->bt_heap_last = sentinel;
+  return 0;
+}
 
-  /* First block of LIFO */
-  bt_make(heap_start + 3, ALIGNMENT,
-          USED); /* Header of the first block of LIFO */
-  bt_make(heap_start + 6, ALIGNMENT,
-          USED); /* Footer of the first block of LIFO */
-  lifo_create_next(
-    heap_start + 3,
-    heap_start +
-      7); /* Distance to the last block of LIFO is in 2 word of the block*/
-  *(heap_start + 5) =
-    0; /* First block of LIFO don't have previous block in LIFO */
-
-  /* Last block of LIFO */
-  bt_make(heap_start + 7, ALIGNMENT,
-          USED); /* Header of the last block of LIFO */
-  bt_make(heap_start + 10, ALIGNMENT,
-          USED);         /* Footer of the last block of LIFO */
-  *(heap_start + 8) = 0; /* First block of LIFO don't have next block in LIFO */
-  lifo_create_prev(
-    heap_start + 7,
-    heap_start +
-      3); /* Distance to the first block of LIFO is in 3 word of the block*/
-
-  heap_start += 4;
-  bt_heap_start = bt_fromptr(heap_start);
-  bt_heap_last = bt_heap_start + 4;
+int mm_init(void) {
+#if THREADS
+  heap_epoch++;
+#endif
+  for (int region = 0; region < ARENAS; region++) {
+    if (arena_init(region) < 0) {
+      return -1;
+    }
+  }
   return 0;
 }
 
 /* --=[ malloc ]=----------------------------------------------------------- */
 
-#if 0
+/* List walks fetch the next block while the current one is being checked,
+ * since its link sits next to the header that is read anyway. */
+#if FIT_POLICY == FIT_FIRST
 /* First fit startegy. */
-static word_t *find_fit(size_t reqsz) {
-  word_t * current_block = lifo_next(bt_heap_start);
-  while (current_block != NULL && (bt_used(current_block) || (bt_size(current_block) < reqsz))) {
-    current_block = lifo_next(current_block);
+static word_t *find_fit_class(int cls, size_t reqsz) {
+  word_t *current_block = lifo_next(seg_head(cls));
+  int probes = 0;
+  while (current_block != NULL) {
+    word_t *next_block = lifo_next(current_block);
+    __builtin_prefetch(next_block);
+    arena->events.fit_probes++;
+    if (bt_free(current_block) && bt_size(current_block) >= reqsz) {
+      break;
+    }
+    if (++probes == FIT_SCAN_MAX) {
+      return NULL;
+    }
+    current_block = next_block;
   }
   return current_block;
 }
 #else
-/* Best fit startegy. */
-static word_t *find_fit(size_t reqsz) {
-  word_t *current_block = lifo_next(bt_heap_start);
+/* Best fit startegy. Stops at the first exact match, and with FIT_BOUNDED
+ * gives up after FIT_CANDIDATES fitting blocks have been seen. */
+static word_t *find_fit_class(int cls, size_t reqsz) {
+  word_t *current_block = lifo_next(seg_head(cls));
   word_t *result = NULL;
   size_t result_size = 0;
+  int candidates = 0;
+  int probes = 0;
   while (current_block != NULL) {
+    word_t *next_block = lifo_next(current_block);
+    __builtin_prefetch(next_block);
+    arena->events.fit_probes++;
     if (bt_free(current_block) && bt_size(current_block) >= reqsz) {
       if (result == NULL) {
         result = current_block;
@@ -294,31 +733,94 @@ static word_t *find_fit(size_t reqsz) {
         result = current_block;
         result_size = bt_size(current_block);
       }
+      if (result_size == reqsz) {
+        break;
+      }
+      if (FIT_POLICY == FIT_BOUNDED && ++candidates == FIT_CANDIDATES) {
+        break;
+      }
     }
-    current_block = lifo_next(current_block);
+    if (++probes == FIT_SCAN_MAX) {
+      break;
+    }
+    current_block = next_block;
   }
   return result;
 }
 #endif
 
+#if FIT_INDEX > 0
+/* Search index of a free list by the same policy as the list walk. */
+static word_t *find_fit_index(fit_index_t *index, size_t reqsz) {
+  int result = -1;
+  int candidates = 0;
+  int i;
+  for (i = 0; i < index->count; i++) {
+    if (index->size[i] < reqsz) {
+      continue;
+    }
+    if (result < 0 || index->size[i] < index->size[result]) {
+      result = i;
+    }
+    if (FIT_POLICY == FIT_FIRST || index->size[result] == reqsz ||
+        (FIT_POLICY == FIT_BOUNDED && ++candidates == FIT_CANDIDATES)) {
+      i++;
+      break;
+    }
+  }
+  arena->events.fit_probes += i;
+  return result < 0 ? NULL : fit_index_block(index, result);
+}
+#endif
+
+/* Search free list of the request size by FIT_POLICY, with at most
+ * FIT_SCAN_MAX probes. Every block on a larger list fits, so past that only
+ * the head of the next non-empty list is taken (good fit). Empty lists are
+ * skipped with help of the bitmap, which bounds the search regardless of
+ * list lengths. With no larger list the last block of the heap is tried, as
+ * the walk may have given up before reaching it. */
+static word_t *find_fit(size_t reqsz) {
+  arena->events.fit_searches++;
+  int cls = seg_class(reqsz);
+  uint64_t lists = *seg_bitmap() >> cls;
+  if (lists & 1) {
+#if FIT_INDEX > 0
+    fit_index_t *index = fit_index(cls);
+    word_t *result = index->count >= 0 ? find_fit_index(index, reqsz)
+                                       : find_fit_class(cls, reqsz);
+#else
+    word_t *result = find_fit_class(cls, reqsz);
+#endif
+    if (result != NULL) {
+      return result;
+    }
+  }
+  lists >>= 1;
+  arena->events.fit_probes++;
+  if (lists == 0) {
+    word_t *last = arena->bt_heap_last;
+    return bt_free(last) && bt_size(last) >= reqsz ? last : NULL;
+  }
+  return lifo_next(seg_head(cls + 1 + __builtin_ctzll(lists)));
+}
+
 /* Split free block */
 static void place(word_t *bt, size_t asize) {
   size_t csize = bt_size(bt);
+  lifo_remove(bt);
   if ((csize - asize) >= 16) {
+    arena->events.splits++;
     bt_make(bt, asize, USED);
-    bt_make(bt_footer(bt), asize, USED);
     word_t *bt_new = bt_next(bt);
-    lifo_connect(lifo_prev(bt), bt_new);
-    lifo_connect(bt_new, lifo_next(bt));
     bt_make(bt_new, (csize - asize), FREE);
-    bt_make(bt_footer(bt_new), (csize - asize), FREE);
-    if (bt == bt_heap_last) {
-      bt_heap_last = bt_new;
+    bt_make_footer(bt_new, csize - asize);
+    lifo_add(bt_new);
+    if (bt == arena->bt_heap_last) {
+      arena->bt_heap_last = bt_new;
     }
   } else {
-    lifo_connect(lifo_prev(bt), lifo_next(bt));
     bt_make(bt, csize, USED);
-    bt_make(bt_footer(bt), csize, USED);
+    bt_clr_prevfree(bt_succ(bt));
   }
 }
 
@@ -330,157 +832,1435 @@ static void *extend_heap(size_t size) {
   /* Maintain alignment */
   round_size = (size + ALIGNMENT - 1) & -ALIGNMENT;
 
+  /* Free block covering the arena has to fit in a boundary tag */
+  if (!LARGE_BLOCKS &&
+      mem_region_heapsize(arena->region) + round_size > TAG_MAX) {
+    return NULL;
+  }
+
   /* Allocate */
-  if ((ptr = mem_sbrk(round_size)) == (word_t *)-1) {
+  if ((ptr = mem_sbrk_region(arena->region, round_size)) == (word_t *)-1) {
     return NULL;
   }
+  arena->events.sbrk_calls++;
   bt = bt_fromptr(ptr);
-  /* Initialize free block header/footer and the epilogue header */
-  bt_make(bt, round_size, FREE);            /* Free block header */
-  bt_make(bt_footer(bt), round_size, FREE); /* Free block footer */
-  bt_heap_last = bt;
+  /* Initialize free block header, footer is created by coalesce */
+  bt_make(bt, round_size, bt_free(arena->bt_heap_last) ? PREVFREE : FREE);
+  arena->bt_heap_last = bt;
   /* Coalesce if the previous block was free */
   return coalesce(ptr);
 }
 
-void *malloc(size_t size) {
-  // printf("m\n");
-  size_t asize;
+/* Calculate how much the heap has to grow to fit a block of asize bytes. */
+static size_t grow_size(size_t asize) {
+  size_t size = asize;
+  word_t *last = arena->bt_heap_last;
+  if (GROW_SHORTFALL && bt_free(last) && bt_size(last) < size) {
+    size -= bt_size(last);
+  }
+  if (size < GROW_MIN) {
+    size = GROW_MIN;
+  }
+  if (size < mem_region_heapsize(arena->region) / 100 * GROW_RATIO) {
+    size = mem_region_heapsize(arena->region) / 100 * GROW_RATIO;
+  }
+  return size;
+}
+
+/* Shrink the heap if its last block is free and large enough. Called
+ * wherever a free block may have been left at the top of the heap: on free,
+ * realloc shrink or move, release of an empty slab and quick list sweep. */
+static void heap_trim(void) {
+  word_t *bt = arena->bt_heap_last;
+  if (TRIM_THRESHOLD == 0 || bt_used(bt) || bt_size(bt) < TRIM_THRESHOLD) {
+    return;
+  }
+  /* New end of the heap is one word past the end of last block */
+  size_t pagesize = mem_pagesize();
+  uintptr_t end = (uintptr_t)(bt + 1) + ALIGNMENT + TRIM_PAD;
+  end = (end + pagesize - 1) & -pagesize;
+  size_t size = end - sizeof(word_t) - (uintptr_t)bt;
+  if (size >= bt_size(bt) ||
+      mem_trim_region(arena->region, bt_size(bt) - size) < 0) {
+    return;
+  }
+  arena->events.trims++;
+  lifo_remove(bt);
+  bt_make(bt, size, FREE);
+  bt_make_footer(bt, size);
+  lifo_add(bt);
+}
+
+/* --=[ quick lists ]=----------------------------------------------------- */
+
+/* Quick lists are singly linked through LIFO next field. Blocks on them stay
+ * marked as used, so neighbours never coalesce with them. */
+static inline int quick_fits(size_t asize) {
+  return asize > SLAB_MAX && asize <= QUICK_MAX;
+}
+
+static inline word_t *quick_head(size_t asize) {
+  return seg_head(SEG_LISTS + SLAB_CLASSES + (asize - SLAB_MAX) / ALIGNMENT -
+                  1);
+}
+
+static void quick_push(word_t *bt) {
+  word_t *head = quick_head(bt_size(bt));
+  word_t *next_bt = lifo_next(head);
+  lifo_put_next(bt, next_bt ? next_bt - bt : 0);
+  lifo_create_next(head, bt);
+}
+
+static word_t *quick_pop(size_t asize) {
+  word_t *head = quick_head(asize);
+  word_t *bt = lifo_next(head);
+  if (bt != NULL) {
+    word_t *next_bt = lifo_next(bt);
+    lifo_put_next(head, next_bt ? next_bt - head : 0);
+  }
+  return bt;
+}
+
+/* Coalesce all blocks waiting on quick lists. Returns number of blocks
+ * given back to free lists. */
+static int quick_sweep(void) {
+  int count = 0;
+  for (size_t asize = SLAB_MAX + ALIGNMENT; quick_fits(asize);
+       asize += ALIGNMENT) {
+    word_t *bt;
+    while ((bt = quick_pop(asize)) != NULL) {
+      bt_make(bt, asize, FREE | bt_get_prevfree(bt));
+      coalesce(bt_payload(bt));
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Allocate block of asize bytes from free lists or fresh memory. */
+static word_t *block_alloc(size_t asize) {
   size_t extendsize;
   word_t *bt;
 
+  /* Reuse recently freed block of the same size */
+  if (quick_fits(asize) && (bt = quick_pop(asize)) != NULL) {
+    bt_make(bt, asize, USED | bt_get_prevfree(bt));
+    return bt;
+  }
+  /* Search the free list for a fit */
+  if ((bt = find_fit(asize)) != NULL) {
+    place(bt, asize);
+    return bt;
+  }
+  /* Try again once deferred blocks got coalesced. Sweep may have freed up
+   * the top of the heap, it's trimmed only if the heap isn't growing. */
+  if (QUICK_CLASSES > 0 && quick_sweep() > 0 &&
+      (bt = find_fit(asize)) != NULL) {
+    place(bt, asize);
+    heap_trim();
+    return bt;
+  }
+  /* No fit found. Free last block may still hold the request, otherwise get
+   * more memory and place the block */
+  bt = arena->bt_heap_last;
+  if (!bt_free(bt) || bt_size(bt) < asize) {
+    extendsize = grow_size(asize);
+    void *ptr;
+    if ((ptr = extend_heap(extendsize)) == NULL) {
+      return NULL;
+    }
+    bt = bt_fromptr(ptr);
+  }
+  place(bt, asize);
+  return bt;
+}
+
+/* --=[ slab allocator ]=--------------------------------------------------- */
+
+/*
+ * Slab is an ordinary used block that starts with a descriptor:
+ *  - word 0: boundary tag,
+ *  - words 1-2: LIFO links of slab list (shared with free block layout),
+ *  - word 3: distance to first free slot or 0 if slab is full,
+ *  - word 4: number of used slots,
+ *  - word 5: slot size in bytes.
+ * Slots follow the descriptor. Slot boundary tag has SLAB flag set and stores
+ * distance in bytes to the slab in place of block size. Free slot keeps
+ * distance to next free slot in its first payload word.
+ */
+#define SLAB_DESC_WORDS 8
+
+static inline word_t *slab_head(size_t asize) {
+  return seg_head(SEG_LISTS + asize / ALIGNMENT - 1);
+}
+
+static inline word_t *slab_fromslot(word_t *slot) {
+  return slot - bt_size(slot) / sizeof(word_t);
+}
+
+static inline int slab_nslots(word_t *slab) {
+  return (SLAB_SIZE - SLAB_DESC_WORDS * sizeof(word_t)) / slab[5];
+}
+
+/* Get new slab from the heap and thread all its slots on free list */
+static word_t *slab_create(size_t asize) {
+  word_t *slab = block_alloc(SLAB_SIZE);
+  if (slab == NULL) {
+    return NULL;
+  }
+  slab[3] = SLAB_DESC_WORDS;
+  slab[4] = 0;
+  slab[5] = asize;
+  word_t *slot = slab + SLAB_DESC_WORDS;
+  for (int i = slab_nslots(slab); i > 0; i--) {
+    bt_make(slot, (slot - slab) * sizeof(word_t), SLAB);
+    slot[1] = i > 1 ? slot - slab + asize / sizeof(word_t) : 0;
+    slot += asize / sizeof(word_t);
+  }
+  lifo_push(slab_head(asize), slab);
+  return slab;
+}
+
+static void *slab_alloc(size_t asize) {
+  word_t *slab = lifo_next(slab_head(asize));
+  if (lifo_next(slab) == NULL && (slab = slab_create(asize)) == NULL) {
+    return NULL;
+  }
+  word_t *slot = slab + slab[3];
+  slab[3] = slot[1];
+  slab[4]++;
+  if (slab[3] == 0) {
+    lifo_remove(slab); /* Full slabs are not kept on the list */
+  }
+  *slot |= USED;
+  return bt_payload(slot);
+}
+
+/* Size of block or slab slot */
+static inline size_t block_size(word_t *bt) {
+  return (*bt & SLAB) ? slab_fromslot(bt)[5] : bt_size(bt);
+}
+
+static void slab_free(word_t *slot) {
+  word_t *slab = slab_fromslot(slot);
+  word_t *head = slab_head(slab[5]);
+  if (slab[3] == 0) {
+    lifo_push(head, slab);
+  }
+  *slot &= ~USED;
+  slot[1] = slab[3];
+  slab[3] = slot - slab;
+  /* Give an empty slab back to the heap unless it's the only one */
+  if (--slab[4] == 0 &&
+      (lifo_next(head) != slab || lifo_next(lifo_next(slab)) != NULL)) {
+    lifo_remove(slab);
+    bt_make(slab, SLAB_SIZE, FREE | bt_get_prevfree(slab));
+    coalesce(bt_payload(slab));
+    heap_trim();
+  }
+}
+
+static void *heap_alloc(size_t size) {
+  size_t asize;
+  word_t *bt;
+
   /* Ignore spurious requests */
   if (size == 0) {
     return NULL;
   }
 
   /* Adjust block size to include overhead and alignment reqs. */
-  if (size <= 8) {
-    asize = 16;
-  } else {
-    asize = (ALIGNMENT * ((size + 8 + ALIGNMENT - 1) / ALIGNMENT));
+  asize = blksz(size);
+  if (asize <= SLAB_MAX) {
+    return slab_alloc(asize);
   }
-  /* Search the free list for a fit */
-  if ((bt = find_fit(asize)) != NULL) {
-    place(bt, asize);
-    return bt_payload(bt);
-  }
-  /* No fit found. Get more memory and place the block */
-  extendsize = asize;
-  void *ptr;
-  if ((ptr = extend_heap(extendsize)) == NULL) {
+  if ((bt = block_alloc(asize)) == NULL) {
     return NULL;
   }
-  bt = bt_fromptr(ptr);
-  place(bt, asize);
   return bt_payload(bt);
 }
 
 /* --=[ free ]=------------------------------------------------------------- */
 
-void free(void *ptr) {
+static void heap_free(void *ptr) {
   if (ptr == NULL) {
     return;
   }
   word_t *bt = bt_fromptr(ptr);
+  if (*bt & SLAB) {
+    slab_free(bt);
+    return;
+  }
   size_t size = bt_size(bt);
-  bt_make(bt, size, FREE);
-  bt_make(bt_footer(bt), size, FREE);
+  if (quick_fits(size)) {
+    quick_push(bt);
+    return;
+  }
+  bt_make(bt, size, FREE | bt_get_prevfree(bt));
   coalesce(ptr);
+  heap_trim();
 }
 
 /* --=[ realloc ]=---------------------------------------------------------- */
 
-void *realloc(void *old_ptr, size_t size) {
+/* Cut used block down to asize bytes and give back what's left. */
+static void shrink(word_t *bt, size_t asize) {
+  size_t csize = bt_size(bt);
+  if ((csize - asize) >= 16) {
+    arena->events.splits++;
+    bt_make(bt, asize, USED | bt_get_prevfree(bt));
+    word_t *bt_new = bt_next(bt);
+    bt_make(bt_new, (csize - asize), FREE);
+
+    if (bt == arena->bt_heap_last) {
+      arena->bt_heap_last = bt_new;
+    }
+
+    coalesce(bt_payload(bt_new));
+    heap_trim();
+  }
+}
+
+static void *heap_realloc(void *old_ptr, size_t size) {
   /* If size == 0 then this is just free, and we return NULL. */
   if (size == 0) {
-    free(old_ptr);
+    heap_free(old_ptr);
     return NULL;
   }
 
   /* If old_ptr is NULL, then this is just malloc. */
   if (!old_ptr)
-    return malloc(size);
+    return heap_alloc(size);
 
-  size_t asize;
-  if (size <= 8) {
-    asize = 16;
-  } else {
-    asize = (ALIGNMENT * ((size + 8 + ALIGNMENT - 1) / ALIGNMENT));
-  }
+  size_t asize = blksz(size);
   word_t *current_bt = bt_fromptr(old_ptr);
-  word_t *next_bt = NULL;
+  if (*current_bt & SLAB) {
+    size_t slot_size = block_size(current_bt);
+    if (asize <= slot_size) {
+      arena->events.realloc_inplace++;
+      return old_ptr;
+    }
+    void *new_ptr = heap_alloc(size);
+    if (!new_ptr)
+      return NULL;
+    arena->events.realloc_moved++;
+    memcpy(new_ptr, old_ptr, slot_size - sizeof(word_t));
+    heap_free(old_ptr);
+    return new_ptr;
+  }
+  word_t *next_bt = bt_succ(current_bt);
+  bt_flags prevfree = bt_get_prevfree(current_bt);
   size_t old_size = bt_size(current_bt);
   size_t new_size = 0;
-  if (current_bt != bt_heap_last) {
-    next_bt = bt_next(current_bt);
-    if (bt_free(next_bt)) {
-      new_size = old_size + bt_size(next_bt);
-    } else {
-      next_bt = NULL;
-    }
+  if (next_bt != NULL && bt_free(next_bt)) {
+    new_size = old_size + bt_size(next_bt);
+  } else {
+    next_bt = NULL;
   }
 
-  if (asize == old_size) {
+  if (asize <= old_size) {
+    arena->events.realloc_inplace++;
+    shrink(current_bt, asize);
     return old_ptr;
-  } else if (asize < old_size) {
-    size_t csize = bt_size(current_bt);
-    if ((csize - asize) >= 16) {
-      bt_make(current_bt, asize, USED);
-      bt_make(bt_footer(current_bt), asize, USED);
-      word_t *bt_new = bt_next(current_bt);
-      bt_make(bt_new, (csize - asize), FREE);
-      bt_make(bt_footer(bt_new), (csize - asize), FREE);
+  }
 
-      if (current_bt == bt_heap_last) {
-        bt_heap_last = bt_new;
-      }
+  /* Size to ask for when the block has to move or heap has to grow */
+  size_t hint = asize;
+  if (REALLOC_HEADROOM > 0 && (*current_bt & GROWN)) {
+    hint = blksz(size + size / 100 * REALLOC_HEADROOM);
+    if (hint > TAG_MAX) {
+      hint = asize;
+    }
+  }
 
-      lifo_add(bt_new);
+  /* Block that ends the heap can grow by extending the heap */
+  if (asize > new_size &&
+      (current_bt == arena->bt_heap_last || next_bt == arena->bt_heap_last)) {
+    void *ptr = extend_heap(grow_size(hint - old_size));
+    if (ptr != NULL) {
+      next_bt = bt_fromptr(ptr);
+      new_size = old_size + bt_size(next_bt);
     }
-    return old_ptr;
-  } else if (next_bt != NULL && asize <= new_size) {
+  }
+
+  if (next_bt != NULL && asize <= new_size) {
+    arena->events.realloc_inplace++;
+    lifo_remove(next_bt);
     if ((new_size - asize) >= 16) {
-      bt_make(current_bt, asize, USED);
+      arena->events.splits++;
+      bt_make(current_bt, asize, USED | prevfree | GROWN);
       word_t *bt_new = bt_next(current_bt);
-      lifo_connect(lifo_prev(next_bt), bt_new);
-      lifo_connect(bt_new, lifo_next(next_bt));
-      bt_make(bt_footer(current_bt), asize, USED);
       bt_make(bt_new, (new_size - asize), FREE);
-      bt_make(bt_footer(bt_new), (new_size - asize), FREE);
-      if (next_bt == bt_heap_last) {
-        bt_heap_last = bt_new;
+      bt_make_footer(bt_new, new_size - asize);
+      lifo_add(bt_new);
+      if (next_bt == arena->bt_heap_last) {
+        arena->bt_heap_last = bt_new;
       }
     } else {
-      lifo_connect(lifo_prev(next_bt), lifo_next(next_bt));
-      bt_make(current_bt, new_size, USED);
-      bt_make(bt_footer(current_bt), new_size, USED);
-      if (next_bt == bt_heap_last) {
-        bt_heap_last = current_bt;
+      bt_make(current_bt, new_size, USED | prevfree | GROWN);
+      if (next_bt == arena->bt_heap_last) {
+        arena->bt_heap_last = current_bt;
       }
+      bt_clr_prevfree(bt_succ(current_bt));
     }
     return old_ptr;
+  } else if (prevfree && bt_size(bt_prev(current_bt)) +
+                             (next_bt ? new_size : old_size) >=
+                           asize) {
+    /* Absorb previous (and next) free block and move payload down */
+    arena->events.realloc_moved++;
+    word_t *prev_bt = bt_prev(current_bt);
+    word_t *last_bt = next_bt ? next_bt : current_bt;
+    size_t csize = bt_size(prev_bt) + (next_bt ? new_size : old_size);
+    lifo_remove(prev_bt);
+    if (next_bt != NULL) {
+      lifo_remove(next_bt);
+    }
+    memmove(bt_payload(prev_bt), old_ptr, old_size - sizeof(word_t));
+    if ((csize - asize) >= 16) {
+      arena->events.splits++;
+      bt_make(prev_bt, asize, USED | GROWN);
+      word_t *bt_new = bt_next(prev_bt);
+      bt_make(bt_new, (csize - asize), FREE);
+      if (last_bt == arena->bt_heap_last) {
+        arena->bt_heap_last = bt_new;
+      }
+      coalesce(bt_payload(bt_new));
+      heap_trim();
+    } else {
+      bt_make(prev_bt, csize, USED | GROWN);
+      if (last_bt == arena->bt_heap_last) {
+        arena->bt_heap_last = prev_bt;
+      }
+      bt_clr_prevfree(bt_succ(prev_bt));
+    }
+    return bt_payload(prev_bt);
   } else {
-    void *new_ptr = malloc(size);
+    void *new_ptr = heap_alloc(hint - sizeof(word_t));
     if (!new_ptr)
       return NULL;
-    memcpy(new_ptr, old_ptr, old_size - 8);
+    arena->events.realloc_moved++;
+    word_t *new_bt = bt_fromptr(new_ptr);
+    if (!(*new_bt & SLAB)) {
+      /* Leave the headroom as a free block following the new one */
+      shrink(new_bt, asize);
+      *new_bt |= GROWN;
+    }
+    memcpy(new_ptr, old_ptr, old_size - sizeof(word_t));
+    heap_free(old_ptr);
+    return new_ptr;
+  }
+}
+
+/* --=[ aligned allocation ]=---------------------------------------------- */
+
+/* Boundary tag of the first block inside of bt with payload aligned to align
+ * bytes that leaves room for a free block in front (ALIGNMENT at least). */
+static inline word_t *aligned_bt(word_t *bt, size_t align) {
+  uintptr_t payload = (uintptr_t)bt_payload(bt);
+  if (payload & (align - 1)) {
+    payload = (payload + ALIGNMENT + align - 1) & -align;
+  }
+  return bt_fromptr((void *)payload);
+}
+
+/* Search free lists for a block that holds asize bytes at an aligned
+ * payload, first one wins. Blocks from the class of asize upwards are
+ * considered, smaller ones can't fit. */
+static word_t *find_fit_aligned(size_t asize, size_t align) {
+  arena->events.fit_searches++;
+  int cls = seg_class(asize);
+  uint64_t lists = *seg_bitmap() >> cls;
+  while (lists != 0) {
+    int skip = __builtin_ctzll(lists);
+    cls += skip;
+    for (word_t *bt = lifo_next(seg_head(cls)); bt != NULL;
+         bt = lifo_next(bt)) {
+      __builtin_prefetch(lifo_next(bt));
+      arena->events.fit_probes++;
+      size_t lead = (char *)aligned_bt(bt, align) - (char *)bt;
+      if (bt_free(bt) && bt_size(bt) >= asize + lead) {
+        return bt;
+      }
+    }
+    lists = (lists >> skip) >> 1;
+    cls++;
+  }
+  return NULL;
+}
+
+/* Allocate block with payload aligned to align bytes (power of two). Free
+ * block with an aligned payload inside is preferred, otherwise a block is
+ * taken with enough slack for one. Space in front of aligned payload is cut
+ * off as a free block, and the slack behind it is given back as well. */
+static void *heap_memalign(size_t size, size_t align) {
+  if (align <= ALIGNMENT) {
+    return heap_alloc(size);
+  }
+  size_t asize = blksz(size);
+  word_t *bt = find_fit_aligned(asize, align);
+  if (bt != NULL) {
+    place(bt, (char *)aligned_bt(bt, align) - (char *)bt + asize);
+  } else if ((bt = block_alloc(asize + align + ALIGNMENT)) == NULL) {
+    return NULL;
+  }
+  word_t *new_bt = aligned_bt(bt, align);
+  if (new_bt != bt) {
+    size_t lead = (char *)new_bt - (char *)bt;
+    bt_make(new_bt, bt_size(bt) - lead, USED);
+    if (bt == arena->bt_heap_last) {
+      arena->bt_heap_last = new_bt;
+    }
+    bt_make(bt, lead, FREE | bt_get_prevfree(bt));
+    coalesce(bt_payload(bt));
+    bt = new_bt;
+  }
+  shrink(bt, asize);
+  return bt_payload(bt);
+}
+
+/* --=[ arenas ]=---------------------------------------------------------- */
+
+#if ARENAS > 1
+static unsigned arena_count;           /* Threads given an arena */
+static __tls arena_t *thread_arena; /* Arena of calling thread */
+
+static inline arena_t *arena_get(int region) {
+  return mem_region_lo(region);
+}
+
+/* Arena owning the block at given address */
+static inline arena_t *arena_of(void *ptr) {
+  return arena_get(mem_region(ptr));
+}
+
+/* Arena calling thread allocates from, given out round-robin */
+static inline arena_t *arena_home(void) {
+  if (thread_arena == NULL) {
+    unsigned n = __atomic_fetch_add(&arena_count, 1, __ATOMIC_RELAXED);
+    thread_arena = arena_get(n % ARENAS);
+  }
+  return thread_arena;
+}
+
+static inline arena_t *arena_after(arena_t *a) {
+  return arena_get((a->region + 1) % ARENAS);
+}
+
+/* Any thread may push, the list is taken as a whole by lock holder, so there
+ * is no ABA problem. Blocks on the list stay used and are linked through
+ * the first payload word just like in thread caches. */
+static inline void remote_push(arena_t *a, void *ptr) {
+  void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+  do {
+    *(void **)ptr = head;
+  } while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Give blocks from remote list back to the heap. Needs arena lock. */
+static inline void remote_drain(arena_t *a) {
+  if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+  void *ptr = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+  while (ptr != NULL) {
+    void *next = *(void **)ptr;
+    heap_free(ptr);
+    ptr = next;
+  }
+}
+#else
+static inline arena_t *arena_get(int region) {
+  return arena;
+}
+
+static inline arena_t *arena_of(void *ptr) {
+  return arena;
+}
+
+static inline arena_t *arena_home(void) {
+  return arena;
+}
+
+static inline arena_t *arena_after(arena_t *a) {
+  return a;
+}
+
+static inline void remote_push(arena_t *a, void *ptr) {
+}
+
+static inline void remote_drain(arena_t *a) {
+}
+#endif
+
+/* Lock given arena and make it current for calling thread */
+static inline void arena_lock(arena_t *a) {
+#if THREADS
+  pthread_mutex_lock(&a->lock);
+#endif
+#if ARENAS > 1
+  arena = a;
+#endif
+  remote_drain(a);
+}
+
+static inline void arena_unlock(arena_t *a) {
+#if THREADS
+  pthread_mutex_unlock(&a->lock);
+#endif
+}
+
+/* Try arena of calling thread first, then all the others */
+static void *arena_alloc(size_t size, size_t align) {
+  arena_t *home = arena_home();
+  arena_t *a = home;
+  void *ptr;
+  do {
+    arena_lock(a);
+    ptr = heap_memalign(size, align);
+    arena_unlock(a);
+    a = arena_after(a);
+  } while (ptr == NULL && a != home);
+  return ptr;
+}
+
+static void arena_free(void *ptr) {
+  arena_t *a = arena_of(ptr);
+  if (a != arena_home()) {
+    remote_push(a, ptr);
+    return;
+  }
+  arena_lock(a);
+  heap_free(ptr);
+  arena_unlock(a);
+}
+
+/* --=[ thread caches ]=--------------------------------------------------- */
+
+/*
+ * Every thread owns the blocks in its cache. They stay marked as used, so
+ * the heap never touches them, and are linked through the first payload
+ * word. The owner reuses them without locking and gives them back to the
+ * heap when the cache is full or the thread exits. Only blocks of the
+ * thread's own arena are cached, the others go straight back to the arena
+ * they came from through its remote list, so memory freed by a consumer
+ * thread returns to the producer's arena. Calling mm_init starts
+ * a new heap epoch, which makes all caches forget blocks of the old heap.
+ * Headers of cached blocks are never written since other threads may be
+ * updating the PREVFREE flag of a neighbour at the same time.
+ */
+#if THREADS
+typedef struct {
+  unsigned epoch;
+  uint16_t count[TCACHE_CLASSES ? TCACHE_CLASSES : 1];
+  void *head[TCACHE_CLASSES ? TCACHE_CLASSES : 1];
+} tcache_t;
+
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static __tls tcache_t tcache;
+
+/* Thread exit: hand blocks back to the heap they came from */
+static void tcache_flush(void *arg) {
+  tcache_t *tc = arg;
+  if (tc->epoch != heap_epoch) {
+    return;
+  }
+  for (int i = 0; i < TCACHE_CLASSES; i++) {
+    while (tc->head[i] != NULL) {
+      void *ptr = tc->head[i];
+      tc->head[i] = *(void **)ptr;
+      arena_free(ptr);
+    }
+    tc->count[i] = 0;
+  }
+  tc->epoch = 0;
+}
+
+static void tcache_key_create(void) {
+  pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/* Empty the cache of calling thread and tie it to current heap */
+static tcache_t *tcache_attach(void) {
+  tcache_t *tc = &tcache;
+  memset(tc, 0, sizeof(tcache_t));
+  tc->epoch = heap_epoch;
+  pthread_once(&tcache_once, tcache_key_create);
+  pthread_setspecific(tcache_key, tc);
+  return tc;
+}
+
+static inline void *tcache_get(size_t asize) {
+  if (asize > TCACHE_MAX) {
+    return NULL;
+  }
+  tcache_t *tc = &tcache;
+  if (tc->epoch != heap_epoch) {
+    tcache_attach();
+    return NULL;
+  }
+  int i = asize / ALIGNMENT - 1;
+  void *ptr = tc->head[i];
+  if (ptr != NULL) {
+    tc->head[i] = *(void **)ptr;
+    tc->count[i]--;
+  }
+  return ptr;
+}
+
+static inline int tcache_put(void *ptr) {
+  word_t *bt = bt_fromptr(ptr);
+  size_t size = block_size(bt);
+  if (size > TCACHE_MAX || arena_of(ptr) != arena_home()) {
+    return 0;
+  }
+  tcache_t *tc = &tcache;
+  if (tc->epoch != heap_epoch) {
+    tc = tcache_attach();
+  }
+  int i = size / ALIGNMENT - 1;
+  if (tc->count[i] >= TCACHE_COUNT) {
+    return 0;
+  }
+  *(void **)ptr = tc->head[i];
+  tc->head[i] = ptr;
+  tc->count[i]++;
+  return 1;
+}
+#else
+static inline void *tcache_get(size_t asize) {
+  return NULL;
+}
+
+static inline int tcache_put(void *ptr) {
+  return 0;
+}
+#endif
+
+/* --=[ mapped blocks ]=--------------------------------------------------- */
+
+/*
+ * Block mapped on its own starts at page boundary with the length of the
+ * whole mapping, then comes the header marked MMAPPED with zero size, so
+ * that the payload stays aligned. These blocks never enter the heap and
+ * are recognized by public procedures before anything looks at the size.
+ */
+#define MAP_HEADER (2 * sizeof(size_t))
+
+#define MAP_BLOCKS (MMAP_THRESHOLD > 0 || LARGE_BLOCKS)
+
+static inline int bt_mapped(word_t *bt) {
+  return MAP_BLOCKS && (*bt & MMAPPED) == MMAPPED;
+}
+
+/* Whether request of size bytes gets a mapping of its own */
+static inline int map_fits(size_t size) {
+  return (MMAP_THRESHOLD > 0 && size >= MMAP_THRESHOLD) ||
+         (LARGE_BLOCKS && size > MAX_REQUEST);
+}
+
+static inline size_t *map_length(void *ptr) {
+  return (size_t *)((char *)ptr - MAP_HEADER);
+}
+
+/* Length of mapping holding size bytes of payload, 0 if too large */
+static inline size_t map_size(size_t size) {
+  size_t pagesize = mem_pagesize();
+  if (size > SIZE_MAX - MAP_HEADER - pagesize) {
+    return 0;
+  }
+  return (size + MAP_HEADER + pagesize - 1) & -pagesize;
+}
+
+static void *map_alloc(size_t size) {
+  size_t length = map_size(size);
+  void *chunk;
+  if (length == 0 || (chunk = mem_map(length)) == (void *)-1) {
+    return NULL;
+  }
+  *(size_t *)chunk = length;
+  void *ptr = (char *)chunk + MAP_HEADER;
+  bt_make(bt_fromptr(ptr), 0, USED | MMAPPED);
+  return ptr;
+}
+
+static void map_free(void *ptr) {
+  mem_unmap(map_length(ptr), *map_length(ptr));
+}
+
+static void *map_realloc(void *ptr, size_t size) {
+  size_t length = map_size(size);
+  void *chunk;
+  if (length == 0 ||
+      (chunk = mem_remap(map_length(ptr), *map_length(ptr), length)) ==
+        (void *)-1) {
+    return NULL;
+  }
+  *(size_t *)chunk = length;
+  return (char *)chunk + MAP_HEADER;
+}
+
+static inline size_t map_usable_size(void *ptr) {
+  return *map_length(ptr) - MAP_HEADER;
+}
+
+/* --=[ public interface ]=------------------------------------------------- */
+
+#ifndef DRIVER
+/* Interposed allocator has no driver calling mm_init, so the heap is set up
+ * on first call. Fork handlers keep arenas consistent in the child. */
+static int heap_initialized;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+static void heap_atfork_prepare(void) {
+  for (int region = 0; region < ARENAS; region++) {
+    pthread_mutex_lock(&arena_get(region)->lock);
+  }
+}
+
+static void heap_atfork_parent(void) {
+  for (int region = ARENAS - 1; region >= 0; region--) {
+    pthread_mutex_unlock(&arena_get(region)->lock);
+  }
+}
+
+static void heap_atfork_child(void) {
+  for (int region = 0; region < ARENAS; region++) {
+    pthread_mutex_init(&arena_get(region)->lock, NULL);
+  }
+}
+
+static void heap_setup(void) {
+  mem_init();
+  if (mm_init() < 0) {
+    abort();
+  }
+  /* Registering fork handlers may allocate, heap has to be ready by now */
+  __atomic_store_n(&heap_initialized, 1, __ATOMIC_RELEASE);
+  pthread_atfork(heap_atfork_prepare, heap_atfork_parent, heap_atfork_child);
+  capture_init();
+}
+
+static inline void heap_ready(void) {
+  if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE)) {
+    pthread_once(&heap_once, heap_setup);
+  }
+}
+#else
+static inline void heap_ready(void) {
+}
+#endif
+
+/* Sets zeroed if the block is a fresh mapping */
+static inline void *alloc_block(size_t size, int *zeroed) {
+  heap_ready();
+#ifndef DRIVER
+  /* Programs may take NULL for an error, so give out the smallest block */
+  if (size == 0) {
+    size = 1;
+  }
+#endif
+  if (size == 0) {
+    return NULL;
+  }
+  void *ptr = NULL;
+  if (map_fits(size)) {
+    ptr = map_alloc(size);
+  }
+  *zeroed = ptr != NULL;
+  if (ptr == NULL) {
+    if (size > MAX_REQUEST) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    if ((ptr = tcache_get(blksz(size))) == NULL) {
+      ptr = arena_alloc(size, ALIGNMENT);
+    }
+  }
+  if (capture_enabled && ptr != NULL) {
+    capture_alloc(ptr, size);
+  }
+  return ptr;
+}
+
+void *malloc(size_t size) {
+  int zeroed;
+  return alloc_block(size, &zeroed);
+}
+
+void free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  if (capture_enabled) {
+    capture_free(ptr);
+  }
+  if (bt_mapped(bt_fromptr(ptr))) {
+    map_free(ptr);
+  } else if (!tcache_put(ptr)) {
+    arena_free(ptr);
+  }
+}
+
+/* Move block to a mapping of its own once it has grown past threshold.
+ * Returns NULL if it's not worth it or there is no address space left. */
+static void *realloc_map(void *old_ptr, size_t size) {
+  if (!map_fits(size)) {
+    return NULL;
+  }
+  void *new_ptr = map_alloc(size);
+  if (new_ptr != NULL) {
+    size_t old_size = block_size(bt_fromptr(old_ptr)) - sizeof(word_t);
+    memcpy(new_ptr, old_ptr, old_size < size ? old_size : size);
+    if (!tcache_put(old_ptr)) {
+      arena_free(old_ptr);
+    }
+  }
+  return new_ptr;
+}
+
+void *realloc(void *old_ptr, size_t size) {
+  /* Before the size check, so that realloc(NULL, 0) acts as malloc(0) */
+  if (old_ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
     free(old_ptr);
+    return NULL;
+  }
+  if (bt_mapped(bt_fromptr(old_ptr))) {
+    if (capture_enabled) {
+      capture_realloc_begin(old_ptr);
+    }
+    void *new_ptr = map_realloc(old_ptr, size);
+    if (new_ptr == NULL) {
+      errno = ENOMEM;
+    }
+    if (capture_enabled) {
+      capture_realloc_end(new_ptr, size);
+    }
     return new_ptr;
   }
+  if (size > MAX_REQUEST && !map_fits(size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (capture_enabled) {
+    capture_realloc_begin(old_ptr);
+  }
+  void *new_ptr = realloc_map(old_ptr, size);
+  if (new_ptr == NULL && size <= MAX_REQUEST) {
+    arena_t *a = arena_of(old_ptr);
+    arena_lock(a);
+    new_ptr = heap_realloc(old_ptr, size);
+    arena_unlock(a);
+  }
+#if ARENAS > 1
+  /* Owning arena is full, move the block to another one */
+  if (new_ptr == NULL && size <= MAX_REQUEST &&
+      (new_ptr = arena_alloc(size, ALIGNMENT)) != NULL) {
+    size_t old_size = block_size(bt_fromptr(old_ptr)) - sizeof(word_t);
+    memcpy(new_ptr, old_ptr, old_size < size ? old_size : size);
+    if (!tcache_put(old_ptr)) {
+      arena_free(old_ptr);
+    }
+  }
+#endif
+  if (capture_enabled) {
+    capture_realloc_end(new_ptr, size);
+  }
+  return new_ptr;
 }
 
 /* --=[ calloc ]=----------------------------------------------------------- */
 
 void *calloc(size_t nmemb, size_t size) {
-  size_t bytes = nmemb * size;
-  void *new_ptr = malloc(bytes);
-  if (new_ptr)
+  size_t bytes;
+  if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  int zeroed;
+  void *new_ptr = alloc_block(bytes, &zeroed);
+  if (new_ptr && !zeroed)
     memset(new_ptr, 0, bytes);
   return new_ptr;
 }
 
+/* --=[ batch allocation ]=------------------------------------------------ */
+
+/* Carve k blocks of asize bytes out of used block bt of at least k * asize
+ * bytes. Last block takes what is left over. */
+static void batch_split(word_t *bt, size_t asize, int k, void **ptrs) {
+  size_t rest = bt_size(bt);
+  int last = bt == arena->bt_heap_last;
+  bt_flags prevfree = bt_get_prevfree(bt);
+  for (int i = 0; i < k - 1; i++) {
+    bt_make(bt, asize, USED | prevfree);
+    ptrs[i] = bt_payload(bt);
+    rest -= asize;
+    prevfree = 0;
+    bt = bt_next(bt);
+  }
+  bt_make(bt, rest, USED | prevfree);
+  ptrs[k - 1] = bt_payload(bt);
+  if (last) {
+    arena->bt_heap_last = bt;
+  }
+  arena->events.splits += k - 1;
+}
+
+/* Allocate up to n blocks of asize bytes, taking as many as possible out of
+ * a single free block. Returns number of blocks allocated. */
+static int heap_alloc_batch(size_t asize, int n, void **ptrs) {
+  int count = 0;
+  if (asize <= SLAB_MAX) {
+    while (count < n && (ptrs[count] = slab_alloc(asize)) != NULL) {
+      count++;
+    }
+    return count;
+  }
+  while (count < n) {
+    int k = n - count;
+    if (k > TAG_MAX / asize) {
+      k = TAG_MAX / asize;
+    }
+    word_t *bt = block_alloc(k * asize);
+    if (bt == NULL && k > 1) {
+      k = 1;
+      bt = block_alloc(asize);
+    }
+    if (bt == NULL) {
+      break;
+    }
+    batch_split(bt, asize, k, ptrs + count);
+    count += k;
+  }
+  return count;
+}
+
+/* Free blocks sorted by address. Runs of neighbouring blocks are merged
+ * into one free block first, so that each run gets coalesced just once. */
+static void heap_free_batch(void **ptrs, int n) {
+  for (int i = 0; i < n; i++) {
+    word_t *bt = bt_fromptr(ptrs[i]);
+    if ((*bt & SLAB) || quick_fits(bt_size(bt))) {
+      heap_free(ptrs[i]);
+      continue;
+    }
+    size_t size = bt_size(bt);
+    int last = bt == arena->bt_heap_last;
+    while (i + 1 < n) {
+      word_t *next_bt = bt_fromptr(ptrs[i + 1]);
+      if (next_bt != bt + size / sizeof(word_t) || (*next_bt & SLAB) ||
+          quick_fits(bt_size(next_bt))) {
+        break;
+      }
+      arena->events.coalesces++;
+      last = next_bt == arena->bt_heap_last;
+      size += bt_size(next_bt);
+      i++;
+    }
+    if (last) {
+      arena->bt_heap_last = bt;
+    }
+    bt_make(bt, size, FREE | bt_get_prevfree(bt));
+    coalesce(bt_payload(bt));
+  }
+  heap_trim();
+}
+
+static int ptr_compare(const void *a, const void *b) {
+  uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+  return (x > y) - (x < y);
+}
+
+int mm_malloc_batch(size_t size, int n, void **ptrs) {
+  heap_ready();
+  if (size == 0 || n <= 0) {
+    return 0;
+  }
+  if (size > MAX_REQUEST || map_fits(size)) {
+    int count = 0;
+    while (count < n && (ptrs[count] = malloc(size)) != NULL) {
+      count++;
+    }
+    return count;
+  }
+  size_t asize = blksz(size);
+  int count = 0;
+  while (count < n && (ptrs[count] = tcache_get(asize)) != NULL) {
+    count++;
+  }
+  arena_t *home = arena_home();
+  arena_t *a = home;
+  while (count < n) {
+    arena_lock(a);
+    count += heap_alloc_batch(asize, n - count, ptrs + count);
+    arena_unlock(a);
+    if ((a = arena_after(a)) == home) {
+      break;
+    }
+  }
+  if (capture_enabled) {
+    for (int i = 0; i < count; i++) {
+      capture_alloc(ptrs[i], size);
+    }
+  }
+  return count;
+}
+
+void mm_free_batch(void **ptrs, int n) {
+  /* Mapped and cached blocks go first, the rest is sorted by address */
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    void *ptr = ptrs[i];
+    if (ptr == NULL) {
+      continue;
+    }
+    if (capture_enabled) {
+      capture_free(ptr);
+    }
+    if (bt_mapped(bt_fromptr(ptr))) {
+      map_free(ptr);
+    } else if (!tcache_put(ptr)) {
+      ptrs[m++] = ptr;
+    }
+  }
+  qsort(ptrs, m, sizeof(void *), ptr_compare);
+  /* Regions of arenas don't overlap, so blocks of each one come together */
+  for (int i = 0, j; i < m; i = j) {
+    arena_t *a = arena_of(ptrs[i]);
+    for (j = i + 1; j < m && arena_of(ptrs[j]) == a; j++)
+      ;
+    if (a != arena_home()) {
+      while (i < j) {
+        remote_push(a, ptrs[i++]);
+      }
+      continue;
+    }
+    arena_lock(a);
+    heap_free_batch(ptrs + i, j - i);
+    arena_unlock(a);
+  }
+}
+
+/* --=[ regions ]=--------------------------------------------------------- */
+
+/*
+ * Region hands out memory by bumping a pointer through chunks taken with
+ * malloc, so objects carry no boundary tags, and gives all of it back at
+ * once. Region descriptor lives at the start of its first chunk. Requests
+ * larger than a quarter of a chunk get a chunk of their own, linked behind
+ * the one being bumped through, so that its free space isn't thrown away.
+ */
+#define REGION_CHUNK (64 * 1024)
+#define REGION_CHUNK_MIN 1024
+
+typedef struct region_chunk {
+  struct region_chunk *next;
+  size_t unused; /* keeps chunk payload aligned */
+} region_chunk_t;
+
+struct mm_region {
+  region_chunk_t *chunks; /* chunk being bumped through comes first */
+  char *cur, *end;        /* free space of current chunk */
+  size_t chunk_size;      /* bytes of payload of regular chunk */
+};
+
+#define REGION_DESC                                                            \
+  ((sizeof(mm_region_t) + ALIGNMENT - 1) & -ALIGNMENT)
+
+/* Take a chunk of size bytes, it becomes the current one if bump is set. */
+static char *region_chunk(mm_region_t *region, size_t size, int bump) {
+  region_chunk_t *chunk = malloc(sizeof(region_chunk_t) + size);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  if (bump) {
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+  } else {
+    chunk->next = region->chunks->next;
+    region->chunks->next = chunk;
+  }
+  return (char *)(chunk + 1);
+}
+
+static void *region_grow(mm_region_t *region, size_t asize) {
+  if (asize > region->chunk_size / 4) {
+    return region_chunk(region, asize, 0);
+  }
+  char *ptr = region_chunk(region, region->chunk_size, 1);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  region->cur = ptr + asize;
+  region->end = ptr + region->chunk_size;
+  return ptr;
+}
+
+mm_region_t *mm_region_create(size_t chunk_size) {
+  if (chunk_size == 0) {
+    chunk_size = REGION_CHUNK;
+  } else if (chunk_size < REGION_CHUNK_MIN) {
+    chunk_size = REGION_CHUNK_MIN;
+  } else if (chunk_size > MAX_REQUEST) {
+    return NULL;
+  }
+  chunk_size = (chunk_size + ALIGNMENT - 1) & -ALIGNMENT;
+  mm_region_t desc = {.chunk_size = chunk_size};
+  char *ptr = region_chunk(&desc, chunk_size, 1);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  mm_region_t *region = (mm_region_t *)ptr;
+  *region = desc;
+  region->cur = ptr + REGION_DESC;
+  region->end = ptr + chunk_size;
+  return region;
+}
+
+void *mm_region_alloc(mm_region_t *region, size_t size) {
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  size_t asize = size ? (size + ALIGNMENT - 1) & -ALIGNMENT : ALIGNMENT;
+  if (asize <= (size_t)(region->end - region->cur)) {
+    void *ptr = region->cur;
+    region->cur += asize;
+    return ptr;
+  }
+  return region_grow(region, asize);
+}
+
+void mm_region_destroy(mm_region_t *region) {
+  if (region == NULL) {
+    return;
+  }
+  /* Descriptor sits in one of the chunks, so take the list out first */
+  region_chunk_t *chunk = region->chunks;
+  while (chunk != NULL) {
+    region_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+/* --=[ aligned allocation and introspection ]=---------------------------- */
+
+void *memalign(size_t align, size_t size) {
+  if (align == 0 || (align & (align - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (align <= ALIGNMENT) {
+    return malloc(size);
+  }
+  heap_ready();
+#ifndef DRIVER
+  if (size == 0) {
+    size = 1;
+  }
+#endif
+  if (size == 0) {
+    return NULL;
+  }
+  if (align > MAX_REQUEST / 2 || size > MAX_REQUEST - 2 * align) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *ptr = arena_alloc(size, align);
+  if (capture_enabled && ptr != NULL) {
+    capture_alloc(ptr, size);
+  }
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+  if (align == 0 || align % sizeof(void *) != 0 ||
+      (align & (align - 1)) != 0) {
+    return EINVAL;
+  }
+  void *ptr = memalign(align, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  return memalign(align, size);
+}
+
+#ifndef DRIVER
+
+void *valloc(size_t size) {
+  return memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+  size_t pagesize = mem_pagesize();
+  return memalign(pagesize, size ? (size + pagesize - 1) & -pagesize : 1);
+}
+
+size_t malloc_usable_size(void *ptr) {
+  if (ptr == NULL) {
+    return 0;
+  }
+  if (bt_mapped(bt_fromptr(ptr))) {
+    return map_usable_size(ptr);
+  }
+  return block_size(bt_fromptr(ptr)) - sizeof(word_t);
+}
+#endif
+
+/* --=[ mm_stats ]=-------------------------------------------------------- */
+
+/* Smallest block size kept on given free list, inverse of seg_class */
+static size_t seg_min_size(int cls) {
+  if (cls < SEG_SPLIT_BITS) {
+    return ALIGNMENT << cls;
+  }
+  cls -= SEG_SPLIT_BITS;
+  int bits = SEG_SPLIT_BITS + (cls >> SEG_SPLIT_BITS);
+  int sub = cls & ((1 << SEG_SPLIT_BITS) - 1);
+  return (size_t)ALIGNMENT * ((1 << bits) | (sub << (bits - SEG_SPLIT_BITS)));
+}
+
+/* Walk blocks and free lists of current arena adding them up in stats. */
+static void heap_stats(mm_stats_t *stats) {
+  stats->heap_size += mem_region_heapsize(arena->region);
+  for (word_t *bt = arena->heap_start - 1; bt <= arena->bt_heap_last;
+       bt = bt_next(bt)) {
+    if (bt_used(bt)) {
+      stats->used_blocks++;
+      stats->used_bytes += bt_size(bt);
+    } else {
+      stats->free_blocks++;
+      stats->free_bytes += bt_size(bt);
+    }
+  }
+  for (int cls = 0; cls < SEG_LISTS; cls++) {
+    for (word_t *bt = lifo_next(seg_head(cls)); bt != NULL;
+         bt = lifo_next(bt)) {
+      if (bt_free(bt)) {
+        stats->list[cls].blocks++;
+        stats->list[cls].bytes += bt_size(bt);
+      }
+    }
+  }
+  size_t *events = (size_t *)&stats->events;
+  size_t *counts = (size_t *)&arena->events;
+  for (int i = 0; i < sizeof(mm_events_t) / sizeof(size_t); i++) {
+    events[i] += counts[i];
+  }
+}
+
+void mm_stats(mm_stats_t *stats) {
+  heap_ready();
+  memset(stats, 0, sizeof(mm_stats_t));
+  stats->lists = SEG_LISTS;
+  for (int cls = 0; cls < SEG_LISTS; cls++) {
+    stats->list[cls].min_size = seg_min_size(cls);
+  }
+  for (int region = 0; region < ARENAS; region++) {
+    arena_t *a = arena_get(region);
+    arena_lock(a);
+    heap_stats(stats);
+    arena_unlock(a);
+  }
+  stats->mapped_bytes = mem_heapsize() - stats->heap_size;
+}
+
 /* --=[ mm_checkheap ]=----------------------------------------------------- */
 
+/* Report broken heap invariant and stop, the heap can't be trusted anymore. */
+static void check_fail(word_t *bt, const char *msg) {
+  fprintf(stderr, "mm_checkheap: %s (block %p)\n", msg, (void *)bt);
+  abort();
+}
+
+/* Walk blocks of current arena checking tags, then walk its free lists and
+ * check that they hold exactly the free blocks of the heap. */
+static void heap_check(int verbose) {
+  size_t free_blocks = 0, listed = 0;
+  word_t *last = NULL;
+  int prev_free = 0;
+
+  for (word_t *bt = arena->heap_start - 1; bt <= arena->bt_heap_last;
+       bt = bt_next(bt)) {
+    size_t size = bt_size(bt);
+    if (size == 0 || size % ALIGNMENT != 0) {
+      check_fail(bt, "bad block size");
+    }
+    if (!!bt_get_prevfree(bt) != prev_free) {
+      check_fail(bt, "PREVFREE flag doesn't match previous block");
+    }
+    if (bt_free(bt)) {
+      if (prev_free) {
+        check_fail(bt, "free block follows another free block");
+      }
+      word_t *footer = bt_footer(bt);
+      size_t fsize =
+        bt_large(footer) ? *(uint64_t *)(footer - 2) : bt_size(footer);
+      if (fsize != size) {
+        check_fail(bt, "header and footer disagree");
+      }
+      free_blocks++;
+    }
+    prev_free = bt_free(bt);
+    last = bt;
+  }
+  if (last != NULL && last != arena->bt_heap_last) {
+    check_fail(last, "heap walk doesn't end at last block");
+  }
+
+  for (int cls = 0; cls < SEG_LISTS; cls++) {
+    word_t *prev_bt = seg_head(cls);
+    size_t count = 0;
+    /* Every list ends at the sentinel, the only element without next */
+    for (word_t *bt = lifo_next(prev_bt); lifo_next(bt) != NULL;
+         bt = lifo_next(bt)) {
+      if (bt < arena->heap_start - 1 || bt > arena->bt_heap_last) {
+        check_fail(bt, "free list block outside of heap");
+      }
+      if (!bt_free(bt)) {
+        check_fail(bt, "used block on free list");
+      }
+      if (seg_class(bt_size(bt)) != cls) {
+        check_fail(bt, "block on free list of other size class");
+      }
+      if (lifo_prev(bt) != prev_bt) {
+        check_fail(bt, "previous link doesn't match free list");
+      }
+      prev_bt = bt;
+      count++;
+    }
+    if (!(*seg_bitmap() >> cls & 1) != !count) {
+      check_fail(seg_head(cls), "free list bitmap out of date");
+    }
+    listed += count;
+  }
+  if (listed != free_blocks) {
+    check_fail(arena->heap_start, "free blocks missing from free lists");
+  }
+
+  if (verbose > 1) {
+    printf("arena %d: %zu bytes, %zu free blocks\n", arena->region,
+           mem_region_heapsize(arena->region), free_blocks);
+  }
+}
+
 void mm_checkheap(int verbose) {
+  heap_ready();
+  for (int region = 0; region < ARENAS; region++) {
+    arena_t *a = arena_get(region);
+    arena_lock(a);
+    heap_check(verbose);
+    arena_unlock(a);
+  }
 }
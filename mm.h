@@ -7,6 +7,9 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
 
 #else
 
@@ -15,11 +18,70 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t align, size_t size);
+extern int posix_memalign(void **memptr, size_t align, size_t size);
+extern void *aligned_alloc(size_t align, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern int mm_init(void);
 
+/* Events counted since mm_init. */
+typedef struct {
+  size_t fit_searches;    /* free list searches */
+  size_t fit_probes;      /* list entries looked at by the searches */
+  size_t splits;          /* blocks split to give back the rest */
+  size_t coalesces;       /* free blocks merged with a neighbour */
+  size_t realloc_inplace; /* reallocs that kept the payload in place */
+  size_t realloc_moved;   /* reallocs that had to copy the payload */
+  size_t sbrk_calls;      /* heap extensions */
+  size_t trims;           /* memory given back with mem_trim */
+} mm_events_t;
+
+#define MM_STATS_LISTS 64
+
+/* Snapshot of the allocator filled in by mm_stats. Slabs and blocks waiting
+ * on quick lists or in thread caches count as used blocks. */
+typedef struct {
+  size_t heap_size;    /* bytes taken from memlib */
+  size_t mapped_bytes; /* mappings of blocks too large for the heap */
+  size_t used_blocks;  /* blocks in use and their total size */
+  size_t used_bytes;
+  size_t free_blocks; /* free blocks and their total size */
+  size_t free_bytes;
+  int lists; /* free lists in this build */
+  struct {
+    size_t min_size; /* smallest block size kept on the list */
+    size_t blocks;
+    size_t bytes;
+  } list[MM_STATS_LISTS];
+  mm_events_t events;
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/* Allocate up to n blocks of size bytes into ptrs, carved out of one free
+ * block where possible. Returns number of blocks allocated. */
+extern int mm_malloc_batch(size_t size, int n, void **ptrs);
+
+/* Free n blocks at once (NULL entries are skipped). Neighbouring blocks
+ * are coalesced together. Contents of ptrs are undefined afterwards, the
+ * array is used as scratch space. */
+extern void mm_free_batch(void **ptrs, int n);
+
+/* Bump allocator on top of the heap: objects of a region are carved out of
+ * chunks taken with malloc and all of them are released at once by
+ * mm_region_destroy. A region must not be used by two threads at once. */
+typedef struct mm_region mm_region_t;
+
+/* Chunk size 0 picks the default (64KiB). Returns NULL if out of memory. */
+extern mm_region_t *mm_region_create(size_t chunk_size);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_destroy(mm_region_t *region);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
@@ -0,0 +1,39 @@
+/*
+ * trace.h - Allocator request traces shared by mdriver and trace tools.
+ *
+ * Besides the text .rep format read by mdriver, traces can be stored in
+ * binary form: a tracehdr_t followed by num_ops traceop_t records in native
+ * byte order. Records have the same layout as in memory, so a binary trace
+ * is replayed straight from a read-only mapping of the file.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Characterizes a single trace operation (allocator request). Batch
+ * requests cover count blocks with ids from index on, all of one size.
+ * Aligned allocations keep their alignment in count. */
+typedef struct {
+  enum { ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH, MEMALIGN } type;
+  int index;   /* index for free() to use later */
+  int count;   /* number of blocks of batch request or alignment */
+  size_t size; /* byte size of alloc/realloc request */
+} traceop_t;
+
+#define TRACE_MAGIC "MMTRACE" /* first 8 bytes of binary trace */
+#define TRACE_VERSION 2
+
+/* Header of binary trace, fields have the same meaning as in .rep header */
+typedef struct {
+  char magic[8];         /* TRACE_MAGIC with terminating zero */
+  uint32_t version;      /* TRACE_VERSION */
+  uint32_t op_size;      /* sizeof(traceop_t) of the writer */
+  int32_t weight;        /* weight for this trace */
+  int32_t num_ids;       /* number of alloc/realloc ids */
+  int32_t num_ops;       /* number of requests */
+  int32_t ignore_ranges; /* don't check ranges (i.e. this is too big) */
+} tracehdr_t;
+
+#endif /* !__TRACE_H__ */
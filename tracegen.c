@@ -0,0 +1,442 @@
+/*
+ * tracegen.c - Generate synthetic allocator traces for mdriver
+ *
+ * Requests are drawn from parametrized distributions of block size,
+ * lifetime and realloc growth. Trace starts by building up a live set of
+ * the given size, then keeps it around that size while allocating, freeing
+ * and reallocating, and finally frees every block that's left, so it can be
+ * replayed any number of times. Blocks can also come and go in batches of
+ * consecutive ids, replayed with mm_malloc_batch and mm_free_batch. Output
+ * is binary (see trace.h) unless the file name ends with .rep.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* range checks of mdriver are linear in live blocks, skip them beyond this */
+#define RANGES_MAX 10000
+
+/* blocks grown by realloc past this size get a fresh size */
+#define REALLOC_MAX (1 << 20)
+
+typedef enum { SIZE_UNIFORM, SIZE_POWER, SIZE_BIMODAL } size_dist_t;
+typedef enum { LIFE_LIFO, LIFE_FIFO, LIFE_RANDOM, LIFE_PHASED } lifetime_t;
+typedef enum { GROW_GEOMETRIC, GROW_LINEAR, GROW_RANDOM } growth_t;
+
+typedef struct {
+  int id;      /* first id of the batch */
+  int count;   /* number of blocks in the batch */
+  size_t size;
+} block_t;
+
+/*********************
+ * Generator settings
+ *********************/
+
+static size_dist_t size_dist = SIZE_UNIFORM;
+static size_t size_lo = 16, size_hi = 4096; /* range of block sizes */
+static double size_param = 0;               /* alpha or percent of small */
+static lifetime_t lifetime = LIFE_RANDOM;
+static growth_t growth = GROW_GEOMETRIC;
+static size_t growth_step = 64; /* bytes added by linear growth */
+static int realloc_pct = 0;     /* percent of requests that are reallocs */
+static int align_pct = 0;       /* percent of allocations that are aligned */
+static int align_max = 4096;    /* largest alignment of aligned ones */
+static long live_target = 10000;
+static long num_requests = 100000;
+static int batch = 1; /* blocks allocated and freed at once */
+static int threads = 1;
+static int weight = 1;
+static uint64_t rng_state = 1;
+
+/**************************
+ * The generator state
+ **************************/
+
+static traceop_t *ops;
+static long num_ops, max_ops;
+static int num_ids;
+
+/* Live blocks kept as a circular deque in order of allocation */
+static block_t *live;
+static long live_head, live_count, live_size;
+
+static void usage(void);
+static void app_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+
+/*
+ * rng - xorshift64*, the same seed always gives the same trace
+ */
+static uint64_t rng(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* uniform in [0, 1) */
+static double rng_unit(void) {
+  return (rng() >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* uniform in [lo, hi] */
+static size_t rng_range(size_t lo, size_t hi) {
+  return lo + rng() % (hi - lo + 1);
+}
+
+/*
+ * draw_size - Pick a block size from the size distribution
+ */
+static size_t draw_size(void) {
+  switch (size_dist) {
+    case SIZE_POWER: {
+      /* inverse of truncated Pareto distribution function */
+      double alpha = size_param;
+      double tail = pow((double)size_lo / size_hi, alpha);
+      return size_lo * pow(1 - rng_unit() * (1 - tail), -1 / alpha);
+    }
+    case SIZE_BIMODAL:
+      if (rng() % 100 < size_param)
+        return rng_range(size_lo / 2 + 1, size_lo);
+      return rng_range(size_hi / 2 + 1, size_hi);
+    default:
+      return rng_range(size_lo, size_hi);
+  }
+}
+
+/*
+ * grow_size - New size of a block that gets reallocated
+ */
+static size_t grow_size(size_t size) {
+  switch (growth) {
+    case GROW_GEOMETRIC:
+      size = size * 3 / 2 + rng() % 16;
+      break;
+    case GROW_LINEAR:
+      size += growth_step;
+      break;
+    default:
+      return draw_size();
+  }
+  return size > REALLOC_MAX ? draw_size() : size;
+}
+
+static void emit(int type, int index, int count, size_t size) {
+  if (num_ops == max_ops) {
+    max_ops = max_ops ? 2 * max_ops : 1 << 16;
+    if (!(ops = realloc(ops, max_ops * sizeof(traceop_t))))
+      app_error("Out of memory for %ld requests\n", max_ops);
+  }
+  ops[num_ops++] =
+    (traceop_t){.type = type, .index = index, .count = count, .size = size};
+}
+
+static inline block_t *live_at(long i) {
+  return &live[(live_head + i) % live_size];
+}
+
+static void do_alloc(void) {
+  if (live_count == live_size)
+    app_error("Live set grew beyond %ld blocks\n", live_size);
+  if (num_ids > INT32_MAX - batch)
+    app_error("Block ids don't fit in int, lower -n or -b\n");
+  block_t *b = live_at(live_count++);
+  b->id = num_ids;
+  b->count = batch;
+  b->size = draw_size();
+  num_ids += batch;
+  if (batch > 1)
+    emit(ALLOC_BATCH, b->id, b->count, b->size);
+  else if (align_pct > 0 && rng() % 100 < align_pct)
+    emit(MEMALIGN, b->id, 32 << rng() % __builtin_ctz(align_max / 16),
+         b->size);
+  else
+    emit(ALLOC, b->id, 0, b->size);
+}
+
+/*
+ * do_free - Free a block (or a batch) chosen by the lifetime order
+ */
+static void do_free(void) {
+  block_t b;
+  if (lifetime == LIFE_FIFO) {
+    b = *live_at(0);
+    live_head = (live_head + 1) % live_size;
+  } else if (lifetime == LIFE_LIFO) {
+    b = *live_at(live_count - 1);
+  } else {
+    block_t *victim = live_at(rng() % live_count);
+    b = *victim;
+    *victim = *live_at(live_count - 1);
+  }
+  live_count--;
+  if (b.count > 1)
+    emit(FREE_BATCH, b.id, b.count, 0);
+  else
+    emit(FREE, b.id, 0, 0);
+}
+
+/*
+ * do_realloc - Grow a live block, in a batch only one of its blocks
+ */
+static void do_realloc(void) {
+  block_t *b = live_at(rng() % live_count);
+  if (b->count > 1) {
+    emit(REALLOC, b->id + rng() % b->count, 0, grow_size(b->size));
+    return;
+  }
+  b->size = grow_size(b->size);
+  emit(REALLOC, b->id, 0, b->size);
+}
+
+/*
+ * generate - Build up the live set, keep it steady and tear it down.
+ *    Steady state allocates with probability falling from 1 to 0 as the
+ *    live set goes from none to twice the target, so it hovers around the
+ *    target. Phased lifetime instead grows the live set up to the target
+ *    and frees random blocks down to a tenth of it over and over.
+ */
+static void generate(void) {
+  long target = live_target / threads / batch;
+  if (target < 1)
+    target = 1;
+  live_size = lifetime == LIFE_PHASED ? target + 1 : 2 * target + 1;
+  if (!(live = malloc(live_size * sizeof(block_t))))
+    app_error("Out of memory for %ld live blocks\n", live_size);
+
+  int shrinking = 0;
+  for (long i = 0; i < num_requests; i++) {
+    if (live_count > 0 && rng() % 100 < realloc_pct) {
+      do_realloc();
+      continue;
+    }
+    int alloc;
+    if (lifetime == LIFE_PHASED) {
+      if (live_count >= target)
+        shrinking = 1;
+      else if (live_count <= target / 10)
+        shrinking = 0;
+      alloc = !shrinking;
+    } else if (i < target) {
+      alloc = 1;
+    } else {
+      alloc = rng_unit() * 2 * target >= live_count;
+    }
+    if (alloc || live_count == 0)
+      do_alloc();
+    else
+      do_free();
+  }
+
+  while (live_count > 0)
+    do_free();
+}
+
+/*
+ * write_rep - Store the trace in text format read by mdriver
+ */
+static void write_rep(FILE *file, int ignore_ranges) {
+  static const char types[] = {[ALLOC] = 'a', [FREE] = 'f', [REALLOC] = 'r'};
+  fprintf(file, "%d\n%d\n%ld\n%d\n", weight, num_ids, num_ops, ignore_ranges);
+  for (long i = 0; i < num_ops; i++) {
+    if (ops[i].type == FREE)
+      fprintf(file, "f %d\n", ops[i].index);
+    else if (ops[i].type == ALLOC_BATCH)
+      fprintf(file, "A %d %d %zu\n", ops[i].index, ops[i].count,
+              ops[i].size);
+    else if (ops[i].type == FREE_BATCH)
+      fprintf(file, "F %d %d\n", ops[i].index, ops[i].count);
+    else if (ops[i].type == MEMALIGN)
+      fprintf(file, "m %d %d %zu\n", ops[i].index, ops[i].count,
+              ops[i].size);
+    else
+      fprintf(file, "%c %d %zu\n", types[ops[i].type], ops[i].index,
+              ops[i].size);
+  }
+}
+
+static void write_trace(const char *filename) {
+  int ignore_ranges = live_target / threads > RANGES_MAX;
+  size_t len = strlen(filename);
+  FILE *file;
+
+  if (num_ops > INT32_MAX)
+    app_error("Trace of %ld requests is too long\n", num_ops);
+  if (!(file = fopen(filename, "w")))
+    app_error("Could not open %s: %s\n", filename, strerror(errno));
+
+  if (len > 4 && strcmp(filename + len - 4, ".rep") == 0) {
+    write_rep(file, ignore_ranges);
+  } else {
+    tracehdr_t hdr = {.magic = TRACE_MAGIC,
+                      .version = TRACE_VERSION,
+                      .op_size = sizeof(traceop_t),
+                      .weight = weight,
+                      .num_ids = num_ids,
+                      .num_ops = num_ops,
+                      .ignore_ranges = ignore_ranges};
+    fwrite(&hdr, sizeof(hdr), 1, file);
+    fwrite(ops, sizeof(traceop_t), num_ops, file);
+  }
+  if (ferror(file) || fclose(file) != 0)
+    app_error("Could not write %s: %s\n", filename, strerror(errno));
+}
+
+/*
+ * parse_sizes - Parse "uniform:lo:hi", "power:lo:hi[:alpha]" or
+ *    "bimodal:lo:hi[:percent]"
+ */
+static void parse_sizes(const char *arg) {
+  char name[16];
+  double param = -1;
+  int n = sscanf(arg, "%15[a-z]:%zu:%zu:%lf", name, &size_lo, &size_hi,
+                 &param);
+  if (n < 3 || size_lo < 1 || size_hi < size_lo)
+    app_error("Invalid size distribution: %s\n", arg);
+  if (strcmp(name, "uniform") == 0) {
+    size_dist = SIZE_UNIFORM;
+  } else if (strcmp(name, "power") == 0) {
+    size_dist = SIZE_POWER;
+    size_param = param > 0 ? param : 1.5;
+  } else if (strcmp(name, "bimodal") == 0) {
+    size_dist = SIZE_BIMODAL;
+    size_param = param >= 0 && param <= 100 ? param : 90;
+  } else {
+    app_error("Unknown size distribution: %s\n", name);
+  }
+}
+
+static void parse_lifetime(const char *arg) {
+  if (strcmp(arg, "lifo") == 0)
+    lifetime = LIFE_LIFO;
+  else if (strcmp(arg, "fifo") == 0)
+    lifetime = LIFE_FIFO;
+  else if (strcmp(arg, "random") == 0)
+    lifetime = LIFE_RANDOM;
+  else if (strcmp(arg, "phased") == 0)
+    lifetime = LIFE_PHASED;
+  else
+    app_error("Unknown lifetime order: %s\n", arg);
+}
+
+/*
+ * parse_align - Parse "percent[:max]"
+ */
+static void parse_align(const char *arg) {
+  int n = sscanf(arg, "%d:%d", &align_pct, &align_max);
+  if (n < 1 || align_pct < 0 || align_pct > 100 || align_max < 32 ||
+      (align_max & (align_max - 1)) != 0)
+    app_error("Invalid aligned allocations: %s\n", arg);
+}
+
+/*
+ * parse_realloc - Parse "percent[:geometric|:linear[:step]|:random]"
+ */
+static void parse_realloc(const char *arg) {
+  char name[16] = "geometric";
+  int n = sscanf(arg, "%d:%15[a-z]:%zu", &realloc_pct, name, &growth_step);
+  if (n < 1 || realloc_pct < 0 || realloc_pct > 100)
+    app_error("Invalid realloc pattern: %s\n", arg);
+  if (strcmp(name, "geometric") == 0)
+    growth = GROW_GEOMETRIC;
+  else if (strcmp(name, "linear") == 0)
+    growth = GROW_LINEAR;
+  else if (strcmp(name, "random") == 0)
+    growth = GROW_RANDOM;
+  else
+    app_error("Unknown realloc growth: %s\n", name);
+}
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc, argv, "n:l:s:o:r:a:b:j:S:w:h")) != EOF) {
+    switch (c) {
+      case 'n': /* Number of requests before the final frees */
+        num_requests = atol(optarg);
+        break;
+      case 'l': /* Size of live set to keep */
+        live_target = atol(optarg);
+        break;
+      case 's': /* Size distribution */
+        parse_sizes(optarg);
+        break;
+      case 'o': /* Order in which blocks are freed */
+        parse_lifetime(optarg);
+        break;
+      case 'r': /* Share and growth pattern of reallocs */
+        parse_realloc(optarg);
+        break;
+      case 'a': /* Share and alignment of aligned allocations */
+        parse_align(optarg);
+        break;
+      case 'b': /* Blocks that come and go together */
+        batch = atoi(optarg);
+        break;
+      case 'j': /* Trace is replayed on this many threads at once */
+        threads = atoi(optarg);
+        break;
+      case 'S': /* Seed of random numbers */
+        rng_state = strtoull(optarg, NULL, 0) | 1;
+        break;
+      case 'w': /* Weight of the trace */
+        weight = atoi(optarg);
+        break;
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  if (num_requests < 1 || live_target < 1 || threads < 1 || batch < 1 ||
+      weight < 0 || weight > 3)
+    app_error("Requests, live set, batch and threads must be positive, "
+              "weight in {0, 1, 2, 3}\n");
+
+  generate();
+  write_trace(argv[optind]);
+  printf("%s: %ld requests, %d blocks\n", argv[optind], num_ops, num_ids);
+  return EXIT_SUCCESS;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: tracegen [-h] [-n <n>] [-l <n>] [-s <sizes>] "
+                  "[-o <order>] [-r <realloc>] [-a <align>] [-b <n>] "
+                  "[-j <n>] [-S <seed>] [-w <i>] <file>\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-n <n>       Requests before final frees (100000).\n");
+  fprintf(stderr, "\t-l <n>       Live blocks to keep (10000).\n");
+  fprintf(stderr, "\t-s <sizes>   uniform:lo:hi (uniform:16:4096),\n");
+  fprintf(stderr, "\t             power:lo:hi[:alpha] (alpha 1.5),\n");
+  fprintf(stderr, "\t             bimodal:lo:hi[:percent of small] (90).\n");
+  fprintf(stderr, "\t-o <order>   Free order: lifo, fifo, random, phased.\n");
+  fprintf(stderr, "\t-r <realloc> percent[:geometric|:linear[:step]|"
+                  ":random].\n");
+  fprintf(stderr, "\t-a <align>   percent[:max] aligned to 32..max (4096).\n");
+  fprintf(stderr, "\t-b <n>       Allocate and free n blocks at once (1).\n");
+  fprintf(stderr, "\t-j <n>       Split live set for mdriver -t <n>.\n");
+  fprintf(stderr, "\t-S <seed>    Seed of random numbers (1).\n");
+  fprintf(stderr, "\t-w <i>       Weight of the trace (1).\n");
+  fprintf(stderr, "\t<file>       Binary trace, text if it ends with .rep.\n");
+}
+
+static void app_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}